@@ -29,11 +29,17 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <linux/input.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_aux.h>
 #include <compositor.h>
+#ifdef HAVE_LINUX_DMABUF
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+#include <linux-dmabuf.h>
+#endif /* HAVE_LINUX_DMABUF */
 #include <cairo.h>
 #include <cairo-xcb.h>
 #include "libgwater-xcb.h"
@@ -42,10 +48,37 @@
 #include <xcb/xkb.h>
 #include <xcb/xcb_ewmh.h>
 #include <xcb/xfixes.h>
+#include <xcb/shape.h>
 #include <xkbcommon/xkbcommon-x11.h>
 
 #include "backend.h"
 
+typedef struct {
+    xkb_mod_mask_t base_mods;
+    xkb_mod_mask_t latched_mods;
+    xkb_mod_mask_t locked_mods;
+    xkb_layout_index_t base_group;
+    xkb_layout_index_t latched_group;
+    xkb_layout_index_t locked_group;
+} ENXBXkbState;
+
+typedef struct {
+    gint number;
+    xcb_screen_t *screen;
+    /* Screens are laid out side by side in the global space */
+    gint32 x;
+    guint16 width;
+    guint8 depth;
+    xcb_visualtype_t *visual;
+    xcb_colormap_t map;
+    gboolean custom_map;
+    gboolean compositing;
+    gboolean shm;
+    xcb_gcontext_t gc;
+    GQueue window_pool;
+    GArray *stack;
+} ENXBScreen;
+
 typedef struct {
     struct weston_backend base;
     struct weston_compositor *compositor;
@@ -54,625 +87,2214 @@ typedef struct {
     GWaterXcbSource *source;
     xcb_connection_t *xcb_connection;
     gint display;
-    gint screen_number;
-    xcb_screen_t *screen;
-    guint8 depth;
-    xcb_visualtype_t *visual;
-    xcb_colormap_t map;
+    ENXBScreen *screens;
+    gint screens_count;
+    ENXBScreen *screen;
     gboolean randr;
     gboolean xkb;
-    gboolean compositing;
-    gboolean custom_map;
+    xcb_atom_t net_wm_window_opacity;
     gboolean xfixes;
+    gboolean shm;
+    gboolean shape;
     xcb_ewmh_connection_t ewmh;
     gint randr_event_base;
     guint8 xkb_event_base;
     gint xfixes_event_base;
+    guint8 shm_event_base;
     gint32 xkb_device_id;
     struct xkb_context *xkb_context;
 
     GHashTable *heads;
+    GHashTable *modes;
     struct weston_seat core_seat;
     struct weston_output *output;
     GHashTable *views;
+    GHashTable *weston_views;
+    GHashTable *shm_segments;
+    struct wl_list exposed_views;
+    struct {
+        gboolean pending;
+        gdouble x;
+        gdouble y;
+    } motion;
+    struct {
+        gboolean pending;
+        gboolean applied_valid;
+        ENXBXkbState next;
+        ENXBXkbState applied;
+    } xkb_state;
+    struct {
+        xcb_connection_t *connection;
+        gint32 device_id;
+        guint timeout;
+        GThread *thread;
+        GSource *done;
+        gboolean dirty;
+        struct xkb_keymap *result;
+        gchar *result_string;
+        gchar *current_string;
+    } keymap;
+    guint batch_source;
 } ENXBBackend;
 
 typedef struct {
     struct weston_output base;
     gint finish_frame_timer;
+    struct timespec frame_start;
 } ENXBOutput;
 
 typedef struct {
     struct weston_head base;
     struct weston_mode mode;
     ENXBOutput output;
+    ENXBScreen *screen;
+    xcb_randr_output_t id;
+    xcb_randr_crtc_t crtc;
+    gboolean seen;
 } ENXBHead;
 
+typedef struct {
+    xcb_shm_seg_t id;
+    guint8 *data;
+    gsize size;
+    pixman_image_t *image;
+    /* ShmPutImage requests the server may still be reading */
+    guint pending;
+} ENXBShmSegment;
+
+typedef struct {
+    struct wl_listener destroy_listener;
+    struct weston_surface *surface;
+    struct weston_buffer *buffer;
+    guint32 format;
+    pixman_format_code_t pixman_format;
+    gint32 stride;
+    struct weston_size size;
+    gpointer data;
+    guint64 age;
+    cairo_surface_t *cairo_surface;
+    pixman_image_t *image;
+    struct wl_shm_buffer *shm_buffer;
+#ifdef HAVE_LINUX_DMABUF
+    struct linux_dmabuf_buffer *dmabuf;
+#endif /* HAVE_LINUX_DMABUF */
+} ENXBBuffer;
+
+#ifdef HAVE_LINUX_DMABUF
+typedef struct {
+    guint32 format;
+    gpointer data;
+    gsize size;
+} ENXBDmabuf;
+#endif /* HAVE_LINUX_DMABUF */
+
+/* Enough for triple-buffering clients */
+#define ENXB_SURFACE_BUFFERS_CACHE_SIZE 3
+
 typedef struct {
     struct wl_listener destroy_listener;
     ENXBBackend *backend;
     struct weston_surface *surface;
     struct weston_buffer_reference buffer_ref;
-    cairo_surface_t *cairo_surface;
-    struct wl_listener buffer_destroy_listener;
+    ENXBBuffer buffers[ENXB_SURFACE_BUFFERS_CACHE_SIZE];
+    guint64 age;
+    ENXBBuffer *buffer;
+    ENXBShmSegment shm;
+    pixman_region32_t deferred;
+    struct {
+        gpointer data;
+        pixman_image_t *image;
+        cairo_surface_t *cairo_surface;
+    } staging;
+    gboolean full_damage;
     struct weston_size size;
+    struct wl_list views;
 } ENXBSurface;
 
 typedef struct {
     struct wl_listener destroy_listener;
     struct wl_listener surface_destroy_listener;
+    struct wl_list link;
     ENXBBackend *backend;
     struct weston_view *view;
     ENXBSurface *surface;
+    struct weston_output *output;
+    ENXBScreen *screen;
     xcb_window_t window;
+    xcb_pixmap_t pixmap;
     cairo_surface_t *cairo_surface;
-    gboolean mapped;
+    pixman_region32_t expose;
+    struct wl_list expose_link;
+    struct {
+        gint32 x;
+        gint32 y;
+        guint32 width;
+        guint32 height;
+        gboolean mapped;
+        gfloat alpha;
+        guint32 opacity;
+        pixman_region32_t input;
+        pixman_region32_t bounding;
+    } x_state;
+    pixman_region32_t damage;
 } ENXBView;
 
-static void
-_enxb_surface_destroy_notify(struct wl_listener *listener, void *data)
+static gint
+_enxb_shm_segment_create_fd(gsize size)
 {
-    ENXBSurface *self = wl_container_of(listener, self, destroy_listener);
+    static guint serial = 0;
+    gchar name[64];
+    gint fd;
 
-    if ( self->buffer_destroy_listener.notify != NULL )
+    do
     {
-        wl_list_remove(&self->buffer_destroy_listener.link);
-        self->buffer_destroy_listener.notify = NULL;
-    }
-    if ( self->cairo_surface != NULL )
-        cairo_surface_destroy(self->cairo_surface);
+        g_snprintf(name, sizeof(name), "/%s-%d-%u", PACKAGE_NAME, getpid(), serial++);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    } while ( ( fd < 0 ) && ( errno == EEXIST ) );
+    if ( fd < 0 )
+        return -1;
+    shm_unlink(name);
 
-    weston_buffer_reference(&self->buffer_ref, NULL);
+    if ( ftruncate(fd, size) < 0 )
+    {
+        close(fd);
+        return -1;
+    }
 
-    g_free(self);
+    return fd;
 }
 
 static void
-_enxb_surface_buffer_destroy_notify(struct wl_listener *listener, void *data)
+_enxb_shm_segment_clean(ENXBBackend *backend, ENXBShmSegment *self)
 {
-    ENXBSurface *self = wl_container_of(listener, self, buffer_destroy_listener);
-
-    cairo_surface_destroy(self->cairo_surface);
-    self->cairo_surface = NULL;
+    if ( self->image != NULL )
+        pixman_image_unref(self->image);
+    if ( self->data != NULL )
+    {
+        g_hash_table_remove(backend->shm_segments, GUINT_TO_POINTER(self->id));
+        xcb_shm_detach(backend->xcb_connection, self->id);
+        munmap(self->data, self->size);
+    }
+    *self = (ENXBShmSegment) { .id = 0 };
 }
 
-static ENXBSurface *
-_enxb_surface_new(ENXBBackend *backend, struct weston_surface *surface)
+static gboolean
+_enxb_shm_segment_resize(ENXBBackend *backend, ENXBShmSegment *self, gint width, gint height)
 {
-    ENXBSurface *self;
-    self = g_new0(ENXBSurface, 1);
-    self->backend = backend;
-    self->surface = surface;
+    gsize size = (gsize) width * height * 4;
 
-    self->destroy_listener.notify = _enxb_surface_destroy_notify;
-    wl_signal_add(&self->surface->destroy_signal, &self->destroy_listener);
+    if ( self->image != NULL )
+    {
+        if ( ( pixman_image_get_width(self->image) == width ) && ( pixman_image_get_height(self->image) == height ) )
+            return TRUE;
+        pixman_image_unref(self->image);
+        self->image = NULL;
+    }
 
-    return self;
-}
+    if ( size > self->size )
+    {
+        gint fd;
+        guint8 *data;
 
-static ENXBSurface *
-_enxb_surface_from_weston_surface(ENXBBackend *backend, struct weston_surface *surface)
-{
-    struct wl_listener *listener;
-    ENXBSurface *self;
+        _enxb_shm_segment_clean(backend, self);
 
-    listener = wl_signal_get(&surface->destroy_signal, _enxb_surface_destroy_notify);
-    if ( listener != NULL )
-        return wl_container_of(listener, self, destroy_listener);
+        fd = _enxb_shm_segment_create_fd(size);
+        if ( fd < 0 )
+            return FALSE;
 
-    return _enxb_surface_new(backend, surface);
-}
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if ( data == MAP_FAILED )
+        {
+            close(fd);
+            return FALSE;
+        }
 
-static int
-_enxb_renderer_read_pixels(struct weston_output *output, pixman_format_code_t format, void *pixels, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
-{
-    return -1;
+        self->id = xcb_generate_id(backend->xcb_connection);
+        /* The connection takes ownership of the fd */
+        xcb_shm_attach_fd(backend->xcb_connection, self->id, fd, TRUE);
+        self->data = data;
+        self->size = size;
+        g_hash_table_insert(backend->shm_segments, GUINT_TO_POINTER(self->id), self);
+    }
+
+    /* Depth 24 screens ignore the alpha byte */
+    self->image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, (guint32 *) self->data, width * 4);
+    return ( self->image != NULL );
 }
 
 static void
-_enxb_renderer_repaint_output(struct weston_output *output, pixman_region32_t *output_damage)
+_enxb_buffer_clean(ENXBBuffer *self)
 {
+    if ( self->buffer != NULL )
+        wl_list_remove(&self->destroy_listener.link);
+    if ( self->image != NULL )
+        pixman_image_unref(self->image);
+    if ( self->cairo_surface != NULL )
+        cairo_surface_destroy(self->cairo_surface);
+
+    *self = (ENXBBuffer) { .buffer = NULL };
 }
 
 static void
-_enxb_renderer_flush_damage(struct weston_surface *surface)
+_enxb_buffer_destroy_notify(struct wl_listener *listener, void *data)
 {
+    ENXBBuffer *self = wl_container_of(listener, self, destroy_listener);
+    ENXBSurface *surface = self->surface->renderer_state;
+
+    if ( surface->buffer == self )
+        surface->buffer = NULL;
+    _enxb_buffer_clean(self);
 }
 
+static const struct {
+    enum wl_shm_format format;
+    pixman_format_code_t pixman_format;
+    cairo_format_t cairo_format;
+} _enxb_shm_formats[] = {
+    { WL_SHM_FORMAT_ARGB8888,    PIXMAN_a8r8g8b8,    CAIRO_FORMAT_ARGB32 },
+    { WL_SHM_FORMAT_XRGB8888,    PIXMAN_x8r8g8b8,    CAIRO_FORMAT_RGB24 },
+    { WL_SHM_FORMAT_ABGR8888,    PIXMAN_a8b8g8r8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_XBGR8888,    PIXMAN_x8b8g8r8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_RGBA8888,    PIXMAN_r8g8b8a8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_RGBX8888,    PIXMAN_r8g8b8x8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_BGRA8888,    PIXMAN_b8g8r8a8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_BGRX8888,    PIXMAN_b8g8r8x8,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_XRGB2101010, PIXMAN_x2r10g10b10, CAIRO_FORMAT_RGB30 },
+    { WL_SHM_FORMAT_ARGB2101010, PIXMAN_a2r10g10b10, CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_XBGR2101010, PIXMAN_x2b10g10r10, CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_ABGR2101010, PIXMAN_a2b10g10r10, CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_RGB888,      PIXMAN_r8g8b8,      CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_BGR888,      PIXMAN_b8g8r8,      CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_RGB565,      PIXMAN_r5g6b5,      CAIRO_FORMAT_RGB16_565 },
+    { WL_SHM_FORMAT_BGR565,      PIXMAN_b5g6r5,      CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_ARGB1555,    PIXMAN_a1r5g5b5,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_XRGB1555,    PIXMAN_x1r5g5b5,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_ARGB4444,    PIXMAN_a4r4g4b4,    CAIRO_FORMAT_INVALID },
+    { WL_SHM_FORMAT_XRGB4444,    PIXMAN_x4r4g4b4,    CAIRO_FORMAT_INVALID },
+};
+
 static gboolean
-_enxb_surface_attach_shm(ENXBSurface *surface, struct wl_shm_buffer *buffer)
+_enxb_buffer_init_image(ENXBBuffer *self)
 {
-    cairo_format_t format;
-    switch ( wl_shm_buffer_get_format(buffer) )
+    gsize i;
+    for ( i = 0 ; i < G_N_ELEMENTS(_enxb_shm_formats) ; ++i )
+    {
+        if ( _enxb_shm_formats[i].format == self->format )
+            break;
+    }
+    if ( i == G_N_ELEMENTS(_enxb_shm_formats) )
     {
-    case WL_SHM_FORMAT_XRGB8888:
-        format = CAIRO_FORMAT_RGB24;
-    break;
-    case WL_SHM_FORMAT_ARGB8888:
-        format = CAIRO_FORMAT_ARGB32;
-    break;
-    case WL_SHM_FORMAT_RGB565:
-        format = CAIRO_FORMAT_RGB16_565;
-    break;
-    case WL_SHM_FORMAT_RGBX1010102:
-        format = CAIRO_FORMAT_RGB30;
-    break;
-    default:
         g_warning("Unsupported SHM buffer format");
         return FALSE;
     }
 
+    self->pixman_format = _enxb_shm_formats[i].pixman_format;
+
+    /* pixman and cairo want 32-bit aligned rows, see _enxb_buffer_composite() */
+    if ( ( self->stride % 4 ) != 0 )
+        return TRUE;
+
+    self->image = pixman_image_create_bits(self->pixman_format, self->size.width, self->size.height, self->data, self->stride);
+    if ( self->image == NULL )
+        return FALSE;
 
-    gint stride = wl_shm_buffer_get_stride(buffer);
-    surface->size.width = wl_shm_buffer_get_width(buffer);
-    surface->size.height = wl_shm_buffer_get_height(buffer);
+    /* Other formats go through the surface staging image */
+    if ( _enxb_shm_formats[i].cairo_format == CAIRO_FORMAT_INVALID )
+        return TRUE;
 
-    surface->cairo_surface = cairo_image_surface_create_for_data(wl_shm_buffer_get_data(buffer), format, surface->size.width, surface->size.height, stride);
-    if ( cairo_surface_status(surface->cairo_surface) != CAIRO_STATUS_SUCCESS )
+    self->cairo_surface = cairo_image_surface_create_for_data(self->data, _enxb_shm_formats[i].cairo_format, self->size.width, self->size.height, self->stride);
+    if ( cairo_surface_status(self->cairo_surface) != CAIRO_STATUS_SUCCESS )
     {
-        cairo_surface_destroy(surface->cairo_surface);
-        surface->cairo_surface = NULL;
+        cairo_surface_destroy(self->cairo_surface);
+        self->cairo_surface = NULL;
         return FALSE;
     }
 
-    weston_compositor_schedule_repaint(surface->backend->compositor);
     return TRUE;
 }
 
-static void
-_enxb_renderer_attach(struct weston_surface *wsurface, struct weston_buffer *buffer)
+static ENXBBuffer *
+_enxb_surface_get_buffer(ENXBSurface *self, struct weston_buffer *buffer, guint32 format, gint32 stride, gint32 width, gint32 height, gpointer data)
 {
-    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
-    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
-    struct wl_shm_buffer *shm_buffer;
-    gboolean ret = FALSE;
+    ENXBBuffer *entry = &self->buffers[0];
+    gsize i;
 
-    if ( surface->buffer_destroy_listener.notify != NULL )
+    for ( i = 0 ; i < G_N_ELEMENTS(self->buffers) ; ++i )
     {
-        wl_list_remove(&surface->buffer_destroy_listener.link);
-        surface->buffer_destroy_listener.notify = NULL;
-    }
-
-    if ( surface->cairo_surface != NULL )
-    {
-        cairo_surface_destroy(surface->cairo_surface);
-        surface->cairo_surface = NULL;
+        if ( self->buffers[i].buffer == buffer )
+        {
+            entry = &self->buffers[i];
+            break;
+        }
+        if ( ( entry->buffer != NULL ) && ( ( self->buffers[i].buffer == NULL ) || ( self->buffers[i].age < entry->age ) ) )
+            entry = &self->buffers[i];
     }
 
-    weston_buffer_reference(&surface->buffer_ref, buffer);
+    entry->age = ++self->age;
+    if ( ( entry->buffer == buffer ) && ( entry->format == format ) && ( entry->stride == stride ) && ( entry->size.width == width ) && ( entry->size.height == height ) && ( entry->data == data ) )
+        return entry;
 
-    shm_buffer = wl_shm_buffer_get(buffer->resource);
-    if ( shm_buffer != NULL )
-        ret = _enxb_surface_attach_shm(surface, shm_buffer);
+    _enxb_buffer_clean(entry);
+    entry->surface = self->surface;
+    entry->format = format;
+    entry->stride = stride;
+    entry->size.width = width;
+    entry->size.height = height;
+    entry->data = data;
+    entry->age = self->age;
 
-    if ( ret )
+    if ( ! _enxb_buffer_init_image(entry) )
     {
-        surface->buffer_destroy_listener.notify = _enxb_surface_buffer_destroy_notify;
-        wl_signal_add(&buffer->destroy_signal, &surface->buffer_destroy_listener);
+        _enxb_buffer_clean(entry);
+        return NULL;
     }
-    else
-        weston_buffer_reference(&surface->buffer_ref, NULL);
+
+    entry->buffer = buffer;
+    entry->destroy_listener.notify = _enxb_buffer_destroy_notify;
+    wl_signal_add(&buffer->destroy_signal, &entry->destroy_listener);
+
+    return entry;
 }
 
-static void
-_enxb_renderer_surface_set_color(struct weston_surface *surface, float red, float green, float blue, float alpha)
+static ENXBBuffer *
+_enxb_surface_get_shm_buffer(ENXBSurface *self, struct weston_buffer *buffer, struct wl_shm_buffer *shm_buffer)
 {
+    ENXBBuffer *entry;
+
+    entry = _enxb_surface_get_buffer(self, buffer, wl_shm_buffer_get_format(shm_buffer), wl_shm_buffer_get_stride(shm_buffer), wl_shm_buffer_get_width(shm_buffer), wl_shm_buffer_get_height(shm_buffer), wl_shm_buffer_get_data(shm_buffer));
+    if ( entry != NULL )
+        entry->shm_buffer = shm_buffer;
+
+    return entry;
 }
 
-static void
-_enxb_renderer_destroy(struct weston_compositor *compositor)
+#ifdef HAVE_LINUX_DMABUF
+static ENXBBuffer *
+_enxb_surface_get_dmabuf_buffer(ENXBSurface *self, struct weston_buffer *buffer, struct linux_dmabuf_buffer *dmabuf)
 {
-}
+    ENXBDmabuf *map = linux_dmabuf_buffer_get_user_data(dmabuf);
+    struct dmabuf_attributes *attributes = &dmabuf->attributes;
+    ENXBBuffer *entry;
 
+    if ( map == NULL )
+        return NULL;
 
-/** See weston_surface_get_content_size() */
-static void
-_enxb_renderer_surface_get_content_size(struct weston_surface *wsurface, int *width, int *height)
-{
-    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
-    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
+    entry = _enxb_surface_get_buffer(self, buffer, map->format, attributes->stride[0], attributes->width, attributes->height, (guint8 *) map->data + attributes->offset[0]);
+    if ( entry != NULL )
+        entry->dmabuf = dmabuf;
 
-    if ( surface->cairo_surface!= NULL )
-    {
-        *width = surface->size.width;
-        *height = surface->size.height;
-    }
-    else
-    {
-        *width = 0;
-        *height = 0;
-    }
+    return entry;
 }
 
-/** See weston_surface_copy_content() */
-static int
-_enxb_renderer_surface_copy_content(struct weston_surface *surface, void *target, size_t size, int src_x, int src_y, int width, int height)
+static void
+_enxb_dmabuf_sync(struct linux_dmabuf_buffer *dmabuf, guint64 flags)
 {
-    return -1;
-}
+    struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
 
-/** See weston_compositor_import_dmabuf() */
-static bool
-_enxb_renderer_import_dmabuf(struct weston_compositor *compositor, struct linux_dmabuf_buffer *buffer)
-{
-    return false;
+    while ( ( ioctl(dmabuf->attributes.fd[0], DMA_BUF_IOCTL_SYNC, &sync) < 0 ) && ( ( errno == EINTR ) || ( errno == EAGAIN ) ) );
 }
+#endif /* HAVE_LINUX_DMABUF */
 
-/** On error sets num_formats to zero */
 static void
-_enxb_renderer_query_dmabuf_formats(struct weston_compositor *compositor, int **formats, int *num_formats)
+_enxb_buffer_begin_access(ENXBBuffer *self)
 {
-    *formats = NULL;
-    *num_formats = 0;
+    if ( self->shm_buffer != NULL )
+        wl_shm_buffer_begin_access(self->shm_buffer);
+#ifdef HAVE_LINUX_DMABUF
+    else if ( self->dmabuf != NULL )
+        _enxb_dmabuf_sync(self->dmabuf, DMA_BUF_SYNC_START);
+#endif /* HAVE_LINUX_DMABUF */
 }
 
-/** On error sets num_modifiers to zero */
 static void
-_enxb_renderer_query_dmabuf_modifiers(struct weston_compositor *compositor, int format, uint64_t **modifiers, int *num_modifiers)
+_enxb_buffer_end_access(ENXBBuffer *self)
 {
-    *modifiers = NULL;
-    *num_modifiers = 0;
+    if ( self->shm_buffer != NULL )
+        wl_shm_buffer_end_access(self->shm_buffer);
+#ifdef HAVE_LINUX_DMABUF
+    else if ( self->dmabuf != NULL )
+        _enxb_dmabuf_sync(self->dmabuf, DMA_BUF_SYNC_END);
+#endif /* HAVE_LINUX_DMABUF */
 }
 
-static struct weston_renderer _enxb_renderer = {
-    .read_pixels = _enxb_renderer_read_pixels,
-    .repaint_output = _enxb_renderer_repaint_output,
-    .flush_damage = _enxb_renderer_flush_damage,
-    .attach = _enxb_renderer_attach,
-    .surface_set_color = _enxb_renderer_surface_set_color,
-    .destroy = _enxb_renderer_destroy,
-    .surface_get_content_size = _enxb_renderer_surface_get_content_size,
-    .surface_copy_content = _enxb_renderer_surface_copy_content,
-    .import_dmabuf = _enxb_renderer_import_dmabuf,
-    .query_dmabuf_formats = _enxb_renderer_query_dmabuf_formats,
-    .query_dmabuf_modifiers = _enxb_renderer_query_dmabuf_modifiers,
-
-};
-
-
 static void
-_enxb_view_destroy_notify(struct wl_listener *listener, void *data)
+_enxb_buffer_composite(ENXBBuffer *self, pixman_op_t op, pixman_image_t *mask, pixman_image_t *dest, gint32 src_x, gint32 src_y, gint32 dest_x, gint32 dest_y, gint32 width, gint32 height)
 {
-    ENXBView *self = wl_container_of(listener, self, destroy_listener);
+    if ( self->image != NULL )
+    {
+        pixman_image_composite32(op, self->image, mask, dest, src_x, src_y, 0, 0, dest_x, dest_y, width, height);
+        return;
+    }
 
-    cairo_surface_flush(self->cairo_surface);
-    cairo_surface_destroy(self->cairo_surface);
-    xcb_destroy_window(self->backend->xcb_connection, self->window);
+    /* Packed rows (e.g. RGB888) are copied row by row to an aligned image */
+    gint32 x1 = MAX(src_x, 0), y1 = MAX(src_y, 0);
+    gint32 x2 = MIN(src_x + width, self->size.width), y2 = MIN(src_y + height, self->size.height);
+    if ( ( x1 >= x2 ) || ( y1 >= y2 ) )
+        return;
 
-    g_hash_table_remove(self->backend->views, GINT_TO_POINTER(self->window));
+    gsize bpp = PIXMAN_FORMAT_BPP(self->pixman_format) / 8;
+    gsize row = (gsize) ( x2 - x1 ) * bpp;
+    gsize stride = ( row + 3 ) & ~(gsize) 3;
+    guint8 *data = g_malloc(stride * ( y2 - y1 ));
+    gint32 y;
 
-    g_free(self);
-};
+    for ( y = y1 ; y < y2 ; ++y )
+        memcpy(data + (gsize) ( y - y1 ) * stride, (guint8 *) self->data + (gsize) y * self->stride + x1 * bpp, row);
 
+    pixman_image_t *image = pixman_image_create_bits_no_clear(self->pixman_format, x2 - x1, y2 - y1, (guint32 *) data, stride);
+    if ( image != NULL )
+    {
+        pixman_image_composite32(op, image, mask, dest, 0, 0, 0, 0, dest_x + x1 - src_x, dest_y + y1 - src_y, x2 - x1, y2 - y1);
+        pixman_image_unref(image);
+    }
+    g_free(data);
+}
 
 static void
-_enxb_view_surface_destroy_notify(struct wl_listener *listener, void *data)
+_enxb_surface_staging_clean(ENXBSurface *self)
 {
-    ENXBView *self = wl_container_of(listener, self, surface_destroy_listener);
-
-    self->surface = NULL;
+    if ( self->staging.cairo_surface != NULL )
+        cairo_surface_destroy(self->staging.cairo_surface);
+    if ( self->staging.image != NULL )
+        pixman_image_unref(self->staging.image);
+    g_free(self->staging.data);
+
+    self->staging.data = NULL;
+    self->staging.image = NULL;
+    self->staging.cairo_surface = NULL;
 }
 
-static ENXBView *
-_enxb_view_new(ENXBBackend *backend, struct weston_view *view)
+/*
+ * Buffers without a matching cairo format are converted by pixman
+ * into a staging image, which is the SHM segment when we have one
+ */
+static gboolean
+_enxb_surface_staging_update(ENXBSurface *self)
 {
-    ENXBView *self;
-    self = g_new0(ENXBView, 1);
-    self->backend = backend;
-    self->view = view;
-    self->surface = _enxb_surface_from_weston_surface(self->backend, self->view->surface);
-
-    guint32 selmask =  XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP;
-    guint32 selval[] = { 0, 0, 1, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE, backend->map };
-    xcb_void_cookie_t cookie;
-    xcb_generic_error_t *err;
-
-    self->window = xcb_generate_id(self->backend->xcb_connection);
-    cookie = xcb_create_window_checked(self->backend->xcb_connection,
-                      self->backend->depth,                /* depth         */
-                      self->window,
-                      self->backend->screen->root,         /* parent window */
-                      0, 0,                          /* x, y          */
-                      self->surface->size.width,    /* width         */
-                      self->surface->size.height,   /* height        */
-                      0,                             /* border_width  */
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, /* class         */
-                      self->backend->visual->visual_id,    /* visual        */
-                      selmask, selval);              /* masks         */
-    err = xcb_request_check(self->backend->xcb_connection, cookie);
-    if ( err != NULL )
-    {
-        g_warning("Failed to create window, err: %d", err->error_code);
-        free(err);
-        g_free(self);
-        return NULL;
+    if ( self->buffer->cairo_surface != NULL )
+    {
+        _enxb_surface_staging_clean(self);
+        return TRUE;
     }
+    if ( ( self->staging.image != NULL ) && ( ! self->full_damage ) )
+        return TRUE;
 
-    self->cairo_surface = cairo_xcb_surface_create(self->backend->xcb_connection, self->window, self->backend->visual, self->surface->size.width, self->surface->size.height);
-
-    self->destroy_listener.notify = _enxb_view_destroy_notify;
-    wl_signal_add(&self->view->destroy_signal, &self->destroy_listener);
-    self->surface_destroy_listener.notify = _enxb_view_surface_destroy_notify;
-    wl_signal_add(&self->surface->surface->destroy_signal, &self->surface_destroy_listener);
-
-    g_hash_table_insert(self->backend->views, GINT_TO_POINTER(self->window), self);
-
-    return self;
-}
-
-static ENXBView *
-_enxb_view_from_weston_view(ENXBBackend *backend, struct weston_view *view)
-{
-    struct wl_listener *listener;
-    ENXBView *self;
+    _enxb_surface_staging_clean(self);
+    self->full_damage = TRUE;
 
-    listener = wl_signal_get(&view->destroy_signal, _enxb_view_destroy_notify);
-    if ( listener != NULL )
-        return wl_container_of(listener, self, destroy_listener);
+    gint32 width = self->size.width, height = self->size.height;
+    if ( self->shm.image != NULL )
+    {
+        self->staging.image = pixman_image_ref(self->shm.image);
+        self->staging.cairo_surface = cairo_image_surface_create_for_data(self->shm.data, CAIRO_FORMAT_ARGB32, width, height, width * 4);
+    }
+    else
+    {
+        self->staging.data = g_malloc(width * height * 4);
+        self->staging.image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, self->staging.data, width * 4);
+        self->staging.cairo_surface = cairo_image_surface_create_for_data(self->staging.data, CAIRO_FORMAT_ARGB32, width, height, width * 4);
+    }
 
-    return _enxb_view_new(backend, view);
+    if ( ( self->staging.image == NULL ) || ( cairo_surface_status(self->staging.cairo_surface) != CAIRO_STATUS_SUCCESS ) )
+    {
+        _enxb_surface_staging_clean(self);
+        return FALSE;
+    }
+    return TRUE;
 }
 
 static void
-_enxb_view_repaint(ENXBView *self)
+_enxb_surface_destroy_notify(struct wl_listener *listener, void *data)
 {
-    gfloat x, y;
-    weston_view_to_global_float(self->view, 0, 0, &x, &y);
-
-    guint16 mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y;
-    guint32 vals[] = { x, y };
-    xcb_configure_window(self->backend->xcb_connection, self->window, mask, vals);
+    ENXBSurface *self = wl_container_of(listener, self, destroy_listener);
+    ENXBView *view, *tmp;
 
-    if ( ( ! self->mapped ) && ( self->surface != NULL ) && ( self->surface->cairo_surface != NULL ) )
-    {
-        xcb_map_window(self->backend->xcb_connection, self->window);
-        self->mapped = TRUE;
-    }
-    else if ( ( self->mapped ) && ( ( self->surface == NULL ) || ( self->surface->cairo_surface == NULL ) ) )
+    wl_list_for_each_safe(view, tmp, &self->views, link)
     {
-        xcb_unmap_window(self->backend->xcb_connection, self->window);
-        self->mapped = FALSE;
+        wl_list_remove(&view->link);
+        wl_list_init(&view->link);
+        view->surface = NULL;
     }
 
-    xcb_clear_area(self->backend->xcb_connection, TRUE, self->window, 0, 0, 0, 0);
+    gsize i;
+    for ( i = 0 ; i < G_N_ELEMENTS(self->buffers) ; ++i )
+        _enxb_buffer_clean(&self->buffers[i]);
+    _enxb_surface_staging_clean(self);
+    _enxb_shm_segment_clean(self->backend, &self->shm);
+    pixman_region32_fini(&self->deferred);
 
-    xcb_flush(self->backend->xcb_connection);
+    weston_buffer_reference(&self->buffer_ref, NULL);
+    self->surface->renderer_state = NULL;
+
+    g_free(self);
 }
 
-static int
-_enxb_output_enable(struct weston_output *output)
+static ENXBSurface *
+_enxb_surface_new(ENXBBackend *backend, struct weston_surface *surface)
 {
-    return 0;
+    ENXBSurface *self;
+    self = g_new0(ENXBSurface, 1);
+    self->backend = backend;
+    self->surface = surface;
+    pixman_region32_init(&self->deferred);
+    wl_list_init(&self->views);
+
+    self->destroy_listener.notify = _enxb_surface_destroy_notify;
+    wl_signal_add(&self->surface->destroy_signal, &self->destroy_listener);
+    self->surface->renderer_state = self;
+
+    return self;
 }
 
-static int
-_enxb_output_disable(struct weston_output *output)
+static ENXBSurface *
+_enxb_surface_from_weston_surface(ENXBBackend *backend, struct weston_surface *surface)
 {
-    return 0;
+    if ( surface->renderer_state != NULL )
+        return surface->renderer_state;
+
+    return _enxb_surface_new(backend, surface);
 }
 
-static int
-_enxb_output_switch_mode(struct weston_output *output, struct weston_mode *mode)
+static void
+_enxb_surface_composite(ENXBSurface *surface, pixman_op_t op, pixman_image_t *mask, pixman_image_t *dest, gint32 src_x, gint32 src_y, gint32 dest_x, gint32 dest_y, gint32 width, gint32 height)
 {
-    return 0;
+    _enxb_buffer_begin_access(surface->buffer);
+    _enxb_buffer_composite(surface->buffer, op, mask, dest, src_x, src_y, dest_x, dest_y, width, height);
+    _enxb_buffer_end_access(surface->buffer);
+}
+
+/** See weston_output_read_pixels() */
+static int
+_enxb_renderer_read_pixels(struct weston_output *output, pixman_format_code_t format, void *pixels, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    ENXBBackend *backend = wl_container_of(output->compositor->backend, backend, base);
+    struct weston_view *wview;
+    pixman_image_t *image;
+    gint stride = width * ( PIXMAN_FORMAT_BPP(format) / 8 );
+
+    /* Weston asks in framebuffer coordinates, we only lay out views in global ones */
+    if ( ( output->transform != WL_OUTPUT_TRANSFORM_NORMAL ) || ( output->current_scale != 1 ) )
+        return -1;
+
+    image = pixman_image_create_bits_no_clear(format, width, height, pixels, stride);
+    if ( image == NULL )
+        return -1;
+    memset(pixels, 0, stride * height);
+
+    /* Same stacking as the X windows, bottom to top */
+    wl_list_for_each_reverse(wview, &backend->compositor->view_list, link)
+    {
+        ENXBSurface *surface = wview->surface->renderer_state;
+        pixman_image_t *mask = NULL;
+
+        if ( ( wview->plane != &backend->compositor->primary_plane ) || ( surface == NULL ) || ( surface->buffer == NULL ) )
+            continue;
+
+        if ( wview->alpha < 1.0 )
+        {
+            pixman_color_t color = { .alpha = CLAMP(wview->alpha, 0.0, 1.0) * 0xffff };
+            mask = pixman_image_create_solid_fill(&color);
+        }
+
+        gfloat fx, fy;
+        weston_view_to_global_float(wview, 0, 0, &fx, &fy);
+        gint32 dx = (gint32) fx - output->x - x, dy = (gint32) fy - output->y - y;
+        _enxb_surface_composite(surface, PIXMAN_OP_OVER, mask, image, 0, 0, dx, dy, surface->size.width, surface->size.height);
+
+        if ( mask != NULL )
+            pixman_image_unref(mask);
+    }
+
+    pixman_image_unref(image);
+
+    return 0;
+}
+
+static void
+_enxb_renderer_repaint_output(struct weston_output *output, pixman_region32_t *output_damage)
+{
+}
+
+static void
+_enxb_renderer_flush_damage(struct weston_surface *wsurface)
+{
+    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
+    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
+    pixman_region32_t damage;
+    ENXBView *view;
+
+    if ( surface->buffer == NULL )
+        return;
+
+    if ( surface->full_damage )
+        pixman_region32_init_rect(&damage, 0, 0, surface->size.width, surface->size.height);
+    else
+    {
+        pixman_region32_init(&damage);
+        pixman_region32_intersect_rect(&damage, &wsurface->damage, 0, 0, surface->size.width, surface->size.height);
+    }
+    surface->full_damage = FALSE;
+
+    /* Writing now could tear the frames the server is still reading */
+    if ( ( surface->shm.image != NULL ) && ( surface->shm.pending > 0 ) )
+    {
+        pixman_region32_union(&surface->deferred, &surface->deferred, &damage);
+        pixman_region32_fini(&damage);
+        return;
+    }
+    pixman_region32_union(&damage, &damage, &surface->deferred);
+    pixman_region32_clear(&surface->deferred);
+
+    /* The staging image is the SHM segment if both exist */
+    pixman_image_t *target = ( surface->shm.image != NULL ) ? surface->shm.image : surface->staging.image;
+    if ( target != NULL )
+    {
+        pixman_box32_t *rects;
+        gint n, i;
+
+        rects = pixman_region32_rectangles(&damage, &n);
+        _enxb_buffer_begin_access(surface->buffer);
+        for ( i = 0 ; i < n ; ++i )
+            _enxb_buffer_composite(surface->buffer, PIXMAN_OP_SRC, NULL, target, rects[i].x1, rects[i].y1, rects[i].x1, rects[i].y1, rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+        _enxb_buffer_end_access(surface->buffer);
+        if ( surface->staging.cairo_surface != NULL )
+            cairo_surface_mark_dirty(surface->staging.cairo_surface);
+    }
+
+    wl_list_for_each(view, &surface->views, link)
+        pixman_region32_union(&view->damage, &view->damage, &damage);
+
+    pixman_region32_fini(&damage);
+}
+
+static void
+_enxb_renderer_attach(struct weston_surface *wsurface, struct weston_buffer *buffer)
+{
+    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
+    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
+    struct wl_shm_buffer *shm_buffer = NULL;
+#ifdef HAVE_LINUX_DMABUF
+    struct linux_dmabuf_buffer *dmabuf = NULL;
+#endif /* HAVE_LINUX_DMABUF */
+
+    weston_buffer_reference(&surface->buffer_ref, buffer);
+    surface->buffer = NULL;
+
+    if ( buffer != NULL )
+        shm_buffer = wl_shm_buffer_get(buffer->resource);
+    if ( shm_buffer != NULL )
+        surface->buffer = _enxb_surface_get_shm_buffer(surface, buffer, shm_buffer);
+#ifdef HAVE_LINUX_DMABUF
+    else if ( buffer != NULL )
+        dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+    if ( dmabuf != NULL )
+        surface->buffer = _enxb_surface_get_dmabuf_buffer(surface, buffer, dmabuf);
+#endif /* HAVE_LINUX_DMABUF */
+
+    if ( surface->buffer == NULL )
+    {
+        weston_buffer_reference(&surface->buffer_ref, NULL);
+        surface->full_damage = TRUE;
+        return;
+    }
+
+    buffer->shm_buffer = shm_buffer;
+    buffer->width = surface->buffer->size.width;
+    buffer->height = surface->buffer->size.height;
+
+    /* Weston only flushes damage for wl_shm buffers, we flush the others on repaint */
+    if ( ( shm_buffer == NULL ) || ( surface->size.width != buffer->width ) || ( surface->size.height != buffer->height ) )
+        surface->full_damage = TRUE;
+    surface->size.width = buffer->width;
+    surface->size.height = buffer->height;
+
+    gboolean had_shm = ( surface->shm.image != NULL );
+    if ( ! ( backend->shm && _enxb_shm_segment_resize(backend, &surface->shm, surface->size.width, surface->size.height) ) )
+        _enxb_shm_segment_clean(backend, &surface->shm);
+    if ( had_shm != ( surface->shm.image != NULL ) )
+        surface->full_damage = TRUE;
+
+    if ( ! _enxb_surface_staging_update(surface) )
+    {
+        surface->buffer = NULL;
+        weston_buffer_reference(&surface->buffer_ref, NULL);
+        return;
+    }
+
+    weston_surface_schedule_repaint(surface->surface);
+}
+
+static void
+_enxb_renderer_surface_set_color(struct weston_surface *surface, float red, float green, float blue, float alpha)
+{
+}
+
+static void
+_enxb_renderer_destroy(struct weston_compositor *compositor)
+{
+}
+
+
+/** See weston_surface_get_content_size() */
+static void
+_enxb_renderer_surface_get_content_size(struct weston_surface *wsurface, int *width, int *height)
+{
+    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
+    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
+
+    if ( surface->buffer != NULL )
+    {
+        *width = surface->size.width;
+        *height = surface->size.height;
+    }
+    else
+    {
+        *width = 0;
+        *height = 0;
+    }
+}
+
+/** See weston_surface_copy_content() */
+static int
+_enxb_renderer_surface_copy_content(struct weston_surface *wsurface, void *target, size_t size, int src_x, int src_y, int width, int height)
+{
+    ENXBBackend *backend = wl_container_of(wsurface->compositor->backend, backend, base);
+    ENXBSurface *surface = _enxb_surface_from_weston_surface(backend, wsurface);
+    pixman_image_t *image;
+    gint stride = width * 4;
+
+    if ( surface->buffer == NULL )
+        return -1;
+    if ( ( src_x < 0 ) || ( src_y < 0 ) || ( width <= 0 ) || ( height <= 0 ) || ( src_x + width > surface->size.width ) || ( src_y + height > surface->size.height ) )
+        return -1;
+    if ( size < (size_t) stride * height )
+        return -1;
+
+    /* R8G8B8A8 in memory order, as documented for weston_surface_copy_content() */
+    image = pixman_image_create_bits_no_clear(PIXMAN_a8b8g8r8, width, height, target, stride);
+    if ( image == NULL )
+        return -1;
+
+    _enxb_surface_composite(surface, PIXMAN_OP_SRC, NULL, image, src_x, src_y, 0, 0, width, height);
+    pixman_image_unref(image);
+
+    return 0;
+}
+
+#ifdef HAVE_LINUX_DMABUF
+#define ENXB_DRM_FORMAT_MOD_LINEAR 0
+
+/* Only linear single-plane buffers we can map and read directly */
+static const struct {
+    guint32 drm_format;
+    enum wl_shm_format format;
+} _enxb_dmabuf_formats[] = {
+    { 0x34325241 /* AR24 */, WL_SHM_FORMAT_ARGB8888 },
+    { 0x34325258 /* XR24 */, WL_SHM_FORMAT_XRGB8888 },
+    { 0x34324241 /* AB24 */, WL_SHM_FORMAT_ABGR8888 },
+    { 0x34324258 /* XB24 */, WL_SHM_FORMAT_XBGR8888 },
+};
+
+static void
+_enxb_dmabuf_destroy(struct linux_dmabuf_buffer *dmabuf)
+{
+    ENXBDmabuf *self = linux_dmabuf_buffer_get_user_data(dmabuf);
+
+    munmap(self->data, self->size);
+    g_free(self);
+}
+#endif /* HAVE_LINUX_DMABUF */
+
+/** See weston_compositor_import_dmabuf() */
+static bool
+_enxb_renderer_import_dmabuf(struct weston_compositor *compositor, struct linux_dmabuf_buffer *buffer)
+{
+#ifdef HAVE_LINUX_DMABUF
+    struct dmabuf_attributes *attributes = &buffer->attributes;
+    gsize i;
+
+    if ( ( attributes->n_planes != 1 ) || ( attributes->modifier[0] != ENXB_DRM_FORMAT_MOD_LINEAR ) )
+        return false;
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_enxb_dmabuf_formats) ; ++i )
+    {
+        if ( _enxb_dmabuf_formats[i].drm_format == attributes->format )
+            break;
+    }
+    if ( i == G_N_ELEMENTS(_enxb_dmabuf_formats) )
+        return false;
+
+    if ( ( attributes->width <= 0 ) || ( attributes->height <= 0 ) || ( attributes->stride[0] < (guint32) attributes->width * 4 ) )
+        return false;
+
+    off_t size = lseek(attributes->fd[0], 0, SEEK_END);
+    if ( ( size < 0 ) || ( (guint64) attributes->offset[0] + (guint64) attributes->stride[0] * attributes->height > (guint64) size ) )
+        return false;
+
+    gpointer data = mmap(NULL, size, PROT_READ, MAP_SHARED, attributes->fd[0], 0);
+    if ( data == MAP_FAILED )
+        return false;
+
+    ENXBDmabuf *self = g_new0(ENXBDmabuf, 1);
+    self->format = _enxb_dmabuf_formats[i].format;
+    self->data = data;
+    self->size = size;
+    linux_dmabuf_buffer_set_user_data(buffer, self, _enxb_dmabuf_destroy);
+
+    return true;
+#else /* ! HAVE_LINUX_DMABUF */
+    return false;
+#endif /* ! HAVE_LINUX_DMABUF */
+}
+
+/** On error sets num_formats to zero */
+static void
+_enxb_renderer_query_dmabuf_formats(struct weston_compositor *compositor, int **formats, int *num_formats)
+{
+    *formats = NULL;
+    *num_formats = 0;
+
+#ifdef HAVE_LINUX_DMABUF
+    gsize i;
+
+    /* Freed by libweston */
+    *formats = malloc(sizeof(int) * G_N_ELEMENTS(_enxb_dmabuf_formats));
+    if ( *formats == NULL )
+        return;
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_enxb_dmabuf_formats) ; ++i )
+        (*formats)[i] = _enxb_dmabuf_formats[i].drm_format;
+    *num_formats = G_N_ELEMENTS(_enxb_dmabuf_formats);
+#endif /* HAVE_LINUX_DMABUF */
+}
+
+/** On error sets num_modifiers to zero */
+static void
+_enxb_renderer_query_dmabuf_modifiers(struct weston_compositor *compositor, int format, uint64_t **modifiers, int *num_modifiers)
+{
+    *modifiers = NULL;
+    *num_modifiers = 0;
+
+#ifdef HAVE_LINUX_DMABUF
+    gsize i;
+
+    for ( i = 0 ; i < G_N_ELEMENTS(_enxb_dmabuf_formats) ; ++i )
+    {
+        if ( _enxb_dmabuf_formats[i].drm_format == (guint32) format )
+            break;
+    }
+    if ( i == G_N_ELEMENTS(_enxb_dmabuf_formats) )
+        return;
+
+    /* Freed by libweston */
+    *modifiers = malloc(sizeof(uint64_t));
+    if ( *modifiers == NULL )
+        return;
+
+    (*modifiers)[0] = ENXB_DRM_FORMAT_MOD_LINEAR;
+    *num_modifiers = 1;
+#endif /* HAVE_LINUX_DMABUF */
+}
+
+static struct weston_renderer _enxb_renderer = {
+    .read_pixels = _enxb_renderer_read_pixels,
+    .repaint_output = _enxb_renderer_repaint_output,
+    .flush_damage = _enxb_renderer_flush_damage,
+    .attach = _enxb_renderer_attach,
+    .surface_set_color = _enxb_renderer_surface_set_color,
+    .destroy = _enxb_renderer_destroy,
+    .surface_get_content_size = _enxb_renderer_surface_get_content_size,
+    .surface_copy_content = _enxb_renderer_surface_copy_content,
+    .import_dmabuf = _enxb_renderer_import_dmabuf,
+    .query_dmabuf_formats = _enxb_renderer_query_dmabuf_formats,
+    .query_dmabuf_modifiers = _enxb_renderer_query_dmabuf_modifiers,
+
+};
+
+
+/* Enough to absorb a burst of notifications */
+#define ENXB_WINDOW_POOL_SIZE 4
+
+static void
+_enxb_view_release_window(ENXBView *self)
+{
+    ENXBBackend *backend = self->backend;
+    ENXBScreen *screen = self->screen;
+
+    if ( self->window == XCB_NONE )
+        return;
+
+    g_hash_table_remove(backend->views, GINT_TO_POINTER(self->window));
+
+    /* Pending exposures were for this window */
+    pixman_region32_clear(&self->expose);
+    wl_list_remove(&self->expose_link);
+    wl_list_init(&self->expose_link);
+
+    guint i;
+    for ( i = 0 ; i < screen->stack->len ; ++i )
+    {
+        if ( g_array_index(screen->stack, xcb_window_t, i) == self->window )
+        {
+            g_array_remove_index(screen->stack, i);
+            break;
+        }
+    }
+
+    cairo_surface_flush(self->cairo_surface);
+    cairo_surface_destroy(self->cairo_surface);
+    xcb_free_pixmap(backend->xcb_connection, self->pixmap);
+    self->cairo_surface = NULL;
+    self->pixmap = XCB_NONE;
+
+    if ( g_queue_get_length(&screen->window_pool) >= ENXB_WINDOW_POOL_SIZE )
+        xcb_destroy_window(backend->xcb_connection, self->window);
+    else
+    {
+        /* Back to the state of a freshly created window */
+        if ( self->x_state.mapped )
+            xcb_unmap_window(backend->xcb_connection, self->window);
+        if ( self->x_state.opacity != G_MAXUINT32 )
+            xcb_delete_property(backend->xcb_connection, self->window, backend->net_wm_window_opacity);
+        if ( backend->shape && pixman_region32_not_empty(&self->x_state.input) )
+            xcb_shape_rectangles(backend->xcb_connection, XCB_SHAPE_SO_SET, XCB_SHAPE_SK_INPUT, XCB_CLIP_ORDERING_UNSORTED, self->window, 0, 0, 0, NULL);
+        if ( backend->shape && pixman_region32_not_empty(&self->x_state.bounding) )
+            xcb_shape_mask(backend->xcb_connection, XCB_SHAPE_SO_SET, XCB_SHAPE_SK_BOUNDING, self->window, 0, 0, XCB_NONE);
+        g_queue_push_head(&screen->window_pool, GUINT_TO_POINTER(self->window));
+    }
+
+    self->window = XCB_NONE;
+    self->screen = NULL;
+}
+
+static void
+_enxb_view_destroy_notify(struct wl_listener *listener, void *data)
+{
+    ENXBView *self = wl_container_of(listener, self, destroy_listener);
+
+    if ( self->surface != NULL )
+    {
+        wl_list_remove(&self->surface_destroy_listener.link);
+        wl_list_remove(&self->link);
+    }
+
+    _enxb_view_release_window(self);
+    wl_list_remove(&self->expose_link);
+    pixman_region32_fini(&self->expose);
+
+    g_hash_table_remove(self->backend->weston_views, self->view);
+
+    pixman_region32_fini(&self->damage);
+    pixman_region32_fini(&self->x_state.input);
+    pixman_region32_fini(&self->x_state.bounding);
+
+    g_free(self);
+};
+
+
+static void
+_enxb_view_surface_destroy_notify(struct wl_listener *listener, void *data)
+{
+    ENXBView *self = wl_container_of(listener, self, surface_destroy_listener);
+
+    wl_list_remove(&self->link);
+    wl_list_init(&self->link);
+    self->surface = NULL;
+}
+
+static void
+_enxb_view_resize_pixmap(ENXBView *self)
+{
+    if ( self->pixmap != XCB_NONE )
+    {
+        cairo_surface_flush(self->cairo_surface);
+        xcb_free_pixmap(self->backend->xcb_connection, self->pixmap);
+    }
+
+    self->pixmap = xcb_generate_id(self->backend->xcb_connection);
+    xcb_create_pixmap(self->backend->xcb_connection, self->screen->depth, self->pixmap, self->window, self->x_state.width, self->x_state.height);
+
+    if ( self->cairo_surface == NULL )
+        self->cairo_surface = cairo_xcb_surface_create(self->backend->xcb_connection, self->pixmap, self->screen->visual, self->x_state.width, self->x_state.height);
+    else
+        cairo_xcb_surface_set_drawable(self->cairo_surface, self->pixmap, self->x_state.width, self->x_state.height);
+
+    pixman_region32_union_rect(&self->damage, &self->damage, 0, 0, self->x_state.width, self->x_state.height);
+}
+
+static void
+_enxb_view_create_window(ENXBView *self, ENXBScreen *screen)
+{
+    ENXBBackend *backend = self->backend;
+
+    self->screen = screen;
+
+    gfloat fx, fy;
+    weston_view_to_global_float(self->view, 0, 0, &fx, &fy);
+    self->x_state.x = (gint32) fx - screen->x;
+    self->x_state.y = fy;
+    /* X windows cannot be empty */
+    self->x_state.width = MAX(self->surface->size.width, 1);
+    self->x_state.height = MAX(self->surface->size.height, 1);
+
+    self->window = GPOINTER_TO_UINT(g_queue_pop_head(&screen->window_pool));
+    if ( self->window != XCB_NONE )
+    {
+        /* Raise it so it is on top, like a new window */
+        guint32 vals[] = { self->x_state.x, self->x_state.y, self->x_state.width, self->x_state.height, XCB_STACK_MODE_ABOVE };
+        xcb_configure_window(backend->xcb_connection, self->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_STACK_MODE, vals);
+    }
+    else
+    {
+        guint32 selmask =  XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_BIT_GRAVITY | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP;
+        guint32 selval[] = { 0, 0, XCB_GRAVITY_NORTH_WEST, 1, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_ENTER_WINDOW | XCB_EVENT_MASK_LEAVE_WINDOW, screen->map };
+
+        /* Errors are reported in the event callback */
+        self->window = xcb_generate_id(backend->xcb_connection);
+        xcb_create_window(backend->xcb_connection,
+                          screen->depth,                 /* depth         */
+                          self->window,
+                          screen->screen->root,          /* parent window */
+                          self->x_state.x,               /* x             */
+                          self->x_state.y,               /* y             */
+                          self->x_state.width,           /* width         */
+                          self->x_state.height,          /* height        */
+                          0,                             /* border_width  */
+                          XCB_WINDOW_CLASS_INPUT_OUTPUT, /* class         */
+                          screen->visual->visual_id,     /* visual        */
+                          selmask, selval);              /* masks         */
+
+        /* Start with no input at all, to match our empty input state */
+        if ( backend->shape )
+            xcb_shape_rectangles(backend->xcb_connection, XCB_SHAPE_SO_SET, XCB_SHAPE_SK_INPUT, XCB_CLIP_ORDERING_UNSORTED, self->window, 0, 0, 0, NULL);
+    }
+
+    self->x_state.mapped = FALSE;
+    self->x_state.alpha = 1.0;
+    self->x_state.opacity = G_MAXUINT32;
+    pixman_region32_clear(&self->x_state.input);
+    pixman_region32_clear(&self->x_state.bounding);
+
+    _enxb_view_resize_pixmap(self);
+
+    g_array_append_val(screen->stack, self->window);
+    g_hash_table_insert(backend->views, GINT_TO_POINTER(self->window), self);
+}
+
+static ENXBView *
+_enxb_view_new(ENXBBackend *backend, struct weston_view *view)
+{
+    ENXBView *self;
+    self = g_new0(ENXBView, 1);
+    self->backend = backend;
+    self->view = view;
+    self->surface = _enxb_surface_from_weston_surface(self->backend, self->view->surface);
+
+    /* The window is created on the first repaint with content */
+    pixman_region32_init(&self->damage);
+    pixman_region32_init(&self->expose);
+    wl_list_init(&self->expose_link);
+    pixman_region32_init(&self->x_state.input);
+    pixman_region32_init(&self->x_state.bounding);
+
+    self->destroy_listener.notify = _enxb_view_destroy_notify;
+    wl_signal_add(&self->view->destroy_signal, &self->destroy_listener);
+    self->surface_destroy_listener.notify = _enxb_view_surface_destroy_notify;
+    wl_signal_add(&self->surface->surface->destroy_signal, &self->surface_destroy_listener);
+    wl_list_insert(&self->surface->views, &self->link);
+
+    g_hash_table_insert(self->backend->weston_views, self->view, self);
+
+    return self;
+}
+
+static void
+_enxb_view_paint(ENXBView *self, pixman_region32_t *region)
+{
+    ENXBSurface *surface = self->surface;
+    pixman_box32_t *rects;
+    gint n, i;
+
+    pixman_region32_intersect_rect(region, region, 0, 0, surface->size.width, surface->size.height);
+    rects = pixman_region32_rectangles(region, &n);
+    if ( n == 0 )
+        return;
+
+    if ( ( surface->shm.image != NULL ) && self->screen->shm && ( self->x_state.alpha >= 1.0 ) )
+    {
+        /* Requests are processed in order, the last completion covers them all */
+        for ( i = 0 ; i < n ; ++i )
+            xcb_shm_put_image(self->backend->xcb_connection, self->pixmap, self->screen->gc,
+                surface->size.width, surface->size.height,
+                rects[i].x1, rects[i].y1, rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1, rects[i].x1, rects[i].y1,
+                self->screen->depth, XCB_IMAGE_FORMAT_Z_PIXMAP, ( i == n - 1 ), surface->shm.id, 0);
+        ++surface->shm.pending;
+        return;
+    }
+
+    cairo_t *cr;
+    cr = cairo_create(self->cairo_surface);
+    for ( i = 0 ; i < n ; ++i )
+        cairo_rectangle(cr, rects[i].x1, rects[i].y1, rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    /* Only the buffer itself is client memory */
+    gboolean direct = ( surface->buffer->cairo_surface != NULL );
+    cairo_set_source_surface(cr, direct ? surface->buffer->cairo_surface : surface->staging.cairo_surface, 0, 0);
+    if ( direct )
+        _enxb_buffer_begin_access(surface->buffer);
+    if ( self->x_state.alpha < 1.0 )
+        cairo_paint_with_alpha(cr, self->x_state.alpha);
+    else
+        cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(self->cairo_surface);
+    if ( direct )
+        _enxb_buffer_end_access(surface->buffer);
+}
+
+static void
+_enxb_view_present(ENXBView *self, pixman_region32_t *region)
+{
+    pixman_box32_t *rects;
+    gint n, i;
+
+    pixman_region32_intersect_rect(region, region, 0, 0, self->x_state.width, self->x_state.height);
+    rects = pixman_region32_rectangles(region, &n);
+    for ( i = 0 ; i < n ; ++i )
+        xcb_copy_area(self->backend->xcb_connection, self->pixmap, self->window, self->screen->gc,
+            rects[i].x1, rects[i].y1, rects[i].x1, rects[i].y1, rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+}
+
+static gboolean
+_enxb_view_update_shape(ENXBView *self, xcb_shape_kind_t kind, pixman_region32_t *current, pixman_region32_t *region)
+{
+    if ( pixman_region32_equal(current, region) )
+        return FALSE;
+    pixman_region32_copy(current, region);
+
+    /* An empty bounding shape means no shape at all */
+    if ( ( kind == XCB_SHAPE_SK_BOUNDING ) && ( ! pixman_region32_not_empty(region) ) )
+    {
+        xcb_shape_mask(self->backend->xcb_connection, XCB_SHAPE_SO_SET, kind, self->window, 0, 0, XCB_NONE);
+        return TRUE;
+    }
+
+    pixman_box32_t *boxes;
+    gint n, i;
+    boxes = pixman_region32_rectangles(region, &n);
+
+    xcb_rectangle_t *rects = g_new(xcb_rectangle_t, n);
+    for ( i = 0 ; i < n ; ++i )
+    {
+        rects[i].x = boxes[i].x1;
+        rects[i].y = boxes[i].y1;
+        rects[i].width = boxes[i].x2 - boxes[i].x1;
+        rects[i].height = boxes[i].y2 - boxes[i].y1;
+    }
+    xcb_shape_rectangles(self->backend->xcb_connection, XCB_SHAPE_SO_SET, kind, XCB_CLIP_ORDERING_YX_BANDED, self->window, 0, 0, n, rects);
+    g_free(rects);
+
+    return TRUE;
+}
+
+static ENXBScreen *
+_enxb_backend_get_output_screen(ENXBBackend *backend, struct weston_output *woutput)
+{
+    ENXBHead *head;
+
+    if ( woutput == NULL )
+        return backend->screen;
+
+    head = wl_container_of(woutput, head, output.base);
+    return head->screen;
+}
+
+static gboolean
+_enxb_view_repaint(ENXBView *self)
+{
+    ENXBScreen *screen = _enxb_backend_get_output_screen(self->backend, self->output);
+    gboolean changed = FALSE;
+
+    /* Windows cannot move to another screen, start over there */
+    if ( ( self->window != XCB_NONE ) && ( self->screen != screen ) )
+    {
+        changed = self->x_state.mapped;
+        _enxb_view_release_window(self);
+    }
+
+    if ( self->window == XCB_NONE )
+    {
+        if ( ( self->surface == NULL ) || ( self->surface->buffer == NULL ) )
+            return changed;
+        _enxb_view_create_window(self, screen);
+    }
+
+    gfloat fx, fy;
+    weston_view_to_global_float(self->view, 0, 0, &fx, &fy);
+    gint32 x = (gint32) fx - screen->x, y = fy;
+
+    guint16 mask = 0;
+    guint32 vals[4], *val = vals;
+    if ( self->x_state.x != x )
+    {
+        mask |= XCB_CONFIG_WINDOW_X;
+        *val++ = x;
+        self->x_state.x = x;
+    }
+    if ( self->x_state.y != y )
+    {
+        mask |= XCB_CONFIG_WINDOW_Y;
+        *val++ = y;
+        self->x_state.y = y;
+    }
+    if ( ( self->surface != NULL ) && ( self->surface->size.width > 0 ) && ( self->surface->size.height > 0 ) )
+    {
+        guint32 width = self->surface->size.width, height = self->surface->size.height;
+        if ( self->x_state.width != width )
+        {
+            mask |= XCB_CONFIG_WINDOW_WIDTH;
+            *val++ = width;
+            self->x_state.width = width;
+        }
+        if ( self->x_state.height != height )
+        {
+            mask |= XCB_CONFIG_WINDOW_HEIGHT;
+            *val++ = height;
+            self->x_state.height = height;
+        }
+        if ( mask & ( XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT ) )
+            _enxb_view_resize_pixmap(self);
+    }
+    if ( mask != 0 )
+    {
+        xcb_configure_window(self->backend->xcb_connection, self->window, mask, vals);
+        changed = TRUE;
+    }
+
+    if ( ( self->surface == NULL ) || ( self->surface->buffer == NULL ) )
+    {
+        pixman_region32_clear(&self->damage);
+        if ( self->x_state.mapped )
+        {
+            xcb_unmap_window(self->backend->xcb_connection, self->window);
+            self->x_state.mapped = FALSE;
+            changed = TRUE;
+        }
+        return changed;
+    }
+
+    if ( self->backend->shape )
+    {
+        /* Without a compositor, transparent pixels would be drawn opaque */
+        pixman_region32_t bounding;
+        pixman_region32_init(&bounding);
+        if ( ! self->screen->compositing )
+            pixman_region32_copy(&bounding, &self->surface->surface->opaque);
+
+        if ( _enxb_view_update_shape(self, XCB_SHAPE_SK_INPUT, &self->x_state.input, &self->surface->surface->input) )
+            changed = TRUE;
+        if ( _enxb_view_update_shape(self, XCB_SHAPE_SK_BOUNDING, &self->x_state.bounding, &bounding) )
+            changed = TRUE;
+
+        pixman_region32_fini(&bounding);
+    }
+
+    /* Let the X compositor apply the alpha if there is one */
+    gfloat alpha = self->view->alpha;
+    guint32 opacity = G_MAXUINT32;
+    if ( self->screen->compositing && ( self->backend->net_wm_window_opacity != XCB_ATOM_NONE ) )
+    {
+        opacity = (gdouble) CLAMP(alpha, 0.0, 1.0) * G_MAXUINT32;
+        alpha = 1.0;
+    }
+
+    if ( self->x_state.opacity != opacity )
+    {
+        if ( opacity == G_MAXUINT32 )
+            xcb_delete_property(self->backend->xcb_connection, self->window, self->backend->net_wm_window_opacity);
+        else
+            xcb_change_property(self->backend->xcb_connection, XCB_PROP_MODE_REPLACE, self->window, self->backend->net_wm_window_opacity, XCB_ATOM_CARDINAL, 32, 1, &opacity);
+        self->x_state.opacity = opacity;
+        changed = TRUE;
+    }
+
+    if ( self->x_state.alpha != alpha )
+    {
+        pixman_region32_union_rect(&self->damage, &self->damage, 0, 0, self->surface->size.width, self->surface->size.height);
+        self->x_state.alpha = alpha;
+    }
+
+    /* The pixmap is always kept up to date, even when unmapped */
+    if ( pixman_region32_not_empty(&self->damage) )
+    {
+        _enxb_view_paint(self, &self->damage);
+        if ( self->x_state.mapped )
+            _enxb_view_present(self, &self->damage);
+        pixman_region32_clear(&self->damage);
+        changed = TRUE;
+    }
+
+    if ( ! self->x_state.mapped )
+    {
+        /* Exposures will copy from the pixmap */
+        xcb_map_window(self->backend->xcb_connection, self->window);
+        self->x_state.mapped = TRUE;
+        changed = TRUE;
+    }
+
+    return changed;
+}
+
+static int
+_enxb_output_enable(struct weston_output *output)
+{
+    return 0;
+}
+
+static int
+_enxb_output_disable(struct weston_output *output)
+{
+    return 0;
+}
+
+static int
+_enxb_output_switch_mode(struct weston_output *output, struct weston_mode *mode)
+{
+    return 0;
+}
+
+static void
+_enxb_output_start_repaint_loop(struct weston_output *output)
+{
+    struct timespec ts;
+
+    weston_compositor_read_presentation_clock(output->compositor, &ts);
+    weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+
+static int
+_enxb_output_finish_frame(gpointer user_data)
+{
+    ENXBOutput *output = user_data;
+
+    /* The next repaint is due one period after this one started */
+    weston_output_finish_frame(&output->base, &output->frame_start, 0);
+    output->finish_frame_timer = 0;
+
+    return G_SOURCE_REMOVE;
+}
+
+static int
+_enxb_output_repaint(struct weston_output *woutput, pixman_region32_t *damage, void *repaint_data)
+{
+    ENXBBackend *backend = wl_container_of(woutput->compositor->backend, backend, base);
+    ENXBOutput *output = wl_container_of(woutput, output, base);
+    struct weston_view *wview;
+    gboolean changed = FALSE;
+
+    weston_compositor_read_presentation_clock(woutput->compositor, &output->frame_start);
+
+    wl_list_for_each_reverse(wview, &backend->compositor->view_list, link)
+    {
+        ENXBView *view = g_hash_table_lookup(backend->weston_views, wview);
+
+        /* The previous owner gets a last repaint to move the view away */
+        if ( ( wview->output != woutput ) && ( ( view == NULL ) || ( view->output != woutput ) ) )
+            continue;
+
+        if ( view == NULL )
+            view = _enxb_view_new(backend, wview);
+        view->output = wview->output;
+
+        if ( ( view->surface != NULL ) && ( view->surface->buffer != NULL ) && ( view->surface->buffer->shm_buffer == NULL ) )
+            _enxb_renderer_flush_damage(view->surface->surface);
+
+        if ( ( view->view->plane == &backend->compositor->primary_plane ) && _enxb_view_repaint(view) )
+            changed = TRUE;
+    }
+    wl_signal_emit(&output->base.frame_signal, &output->base);
+
+    if ( ! changed )
+    {
+        /*
+         * Nothing reached the X server, complete the frame right away
+         * so the repaint loop can go idle until something schedules a repaint
+         */
+        output->finish_frame_timer = g_idle_add(_enxb_output_finish_frame, output);
+        return 0;
+    }
+
+    xcb_flush(backend->xcb_connection);
+
+    /* Round the refresh period (in mHz) to the nearest millisecond */
+    guint32 refresh = output->base.current_mode->refresh;
+    guint interval = MAX(( 1000000 + refresh / 2 ) / refresh, 1);
+    output->finish_frame_timer = g_timeout_add_full(G_PRIORITY_DEFAULT, interval, _enxb_output_finish_frame, output, NULL);
+
+    return 0;
+}
+
+/* Marks in keep the values of a longest increasing subsequence of seq, a permutation of 0..n-1 */
+static void
+_enxb_stack_lis(const guint *seq, guint n, gboolean *keep)
+{
+    guint *tails = g_new(guint, n);
+    guint *prev = g_new(guint, n);
+    guint len = 0, i;
+
+    for ( i = 0 ; i < n ; ++i )
+    {
+        guint lo = 0, hi = len;
+        while ( lo < hi )
+        {
+            guint mid = ( lo + hi ) / 2;
+            if ( seq[tails[mid]] < seq[i] )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[i] = ( lo > 0 ) ? tails[lo - 1] : G_MAXUINT;
+        tails[lo] = i;
+        if ( lo == len )
+            ++len;
+    }
+
+    if ( len > 0 )
+    {
+        for ( i = tails[len - 1] ; i != G_MAXUINT ; i = prev[i] )
+            keep[seq[i]] = TRUE;
+    }
+
+    g_free(prev);
+    g_free(tails);
+}
+
+static void
+_enxb_backend_restack(ENXBBackend *backend, xcb_window_t window, xcb_window_t sibling, guint32 mode)
+{
+    guint32 vals[] = { sibling, mode };
+    xcb_configure_window(backend->xcb_connection, window, XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE, vals);
+}
+
+/*
+ * Windows in the longest run that is already in the right order
+ * stay where they are, so we only restack the ones that moved
+ */
+static void
+_enxb_backend_restack_screen(ENXBBackend *backend, ENXBScreen *screen)
+{
+    struct weston_view *wview;
+    GArray *wanted;
+    GHashTable *positions;
+    guint *current;
+    gboolean *keep;
+    guint n, len, i;
+
+    /* Bottom to top, like the X stacking order */
+    wanted = g_array_new(FALSE, FALSE, sizeof(xcb_window_t));
+    positions = g_hash_table_new(NULL, NULL);
+    wl_list_for_each_reverse(wview, &backend->compositor->view_list, link)
+    {
+        ENXBView *view = g_hash_table_lookup(backend->weston_views, wview);
+        if ( ( view == NULL ) || ( view->window == XCB_NONE ) || ( view->screen != screen ) )
+            continue;
+        g_array_append_val(wanted, view->window);
+        g_hash_table_insert(positions, GUINT_TO_POINTER(view->window), GUINT_TO_POINTER(wanted->len));
+    }
+    n = wanted->len;
+
+    current = g_new(guint, n);
+    keep = g_new0(gboolean, n);
+    GArray *stack = g_array_sized_new(FALSE, FALSE, sizeof(xcb_window_t), screen->stack->len);
+    for ( i = 0, len = 0 ; i < screen->stack->len ; ++i )
+    {
+        xcb_window_t window = g_array_index(screen->stack, xcb_window_t, i);
+        guint position = GPOINTER_TO_UINT(g_hash_table_lookup(positions, GUINT_TO_POINTER(window)));
+        if ( position > 0 )
+            current[len++] = position - 1;
+        else
+            /* Not shown, not restacked */
+            g_array_append_val(stack, window);
+    }
+    _enxb_stack_lis(current, n, keep);
+
+    /* Below the first kept window, then above the previous one */
+    guint first = 0, restacked = 0;
+    while ( ( first < n ) && ( ! keep[first] ) )
+        ++first;
+    for ( i = first ; i > 0 ; --i, ++restacked )
+        _enxb_backend_restack(backend, g_array_index(wanted, xcb_window_t, i - 1), g_array_index(wanted, xcb_window_t, i), XCB_STACK_MODE_BELOW);
+    for ( i = first + 1 ; i < n ; ++i )
+    {
+        if ( keep[i] )
+            continue;
+        _enxb_backend_restack(backend, g_array_index(wanted, xcb_window_t, i), g_array_index(wanted, xcb_window_t, i - 1), XCB_STACK_MODE_ABOVE);
+        ++restacked;
+    }
+    if ( restacked > 0 )
+        xcb_flush(backend->xcb_connection);
+
+    g_array_append_vals(stack, wanted->data, n);
+    g_array_unref(screen->stack);
+    screen->stack = stack;
+
+    g_free(keep);
+    g_free(current);
+    g_hash_table_unref(positions);
+    g_array_unref(wanted);
+}
+
+static void
+_enxb_backend_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
+{
+    ENXBBackend *backend = wl_container_of(compositor->backend, backend, base);
+    gint i;
+
+    /* Only siblings can be restacked relative to each other */
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+        _enxb_backend_restack_screen(backend, &backend->screens[i]);
+}
+
+static void
+_enxb_output_destroy(struct weston_output *woutput)
+{
+    ENXBBackend *backend = wl_container_of(woutput->compositor->backend, backend, base);
+    ENXBHead *head = wl_container_of(woutput, head, output.base);
+
+    if ( head->output.finish_frame_timer > 0 )
+        g_source_remove(head->output.finish_frame_timer);
+    head->output.finish_frame_timer = 0;
+
+    GHashTableIter iter;
+    ENXBView *view;
+    g_hash_table_iter_init(&iter, backend->weston_views);
+    while ( g_hash_table_iter_next(&iter, NULL, (gpointer *) &view) )
+    {
+        if ( view->output == woutput )
+            view->output = NULL;
+    }
+
+    weston_output_release(&head->output.base);
+}
+
+static struct weston_output *
+_enxb_output_create(struct weston_compositor *compositor, const char *name)
+{
+    g_return_val_if_fail(name != NULL, NULL);
+
+    ENXBBackend *backend = wl_container_of(compositor->backend, backend, base);
+    ENXBHead *head;
+
+    head = g_hash_table_lookup(backend->heads, name);
+    g_return_val_if_fail(head != NULL, NULL);
+
+    weston_output_init(&head->output.base, compositor, name);
+
+    head->output.base.destroy = _enxb_output_destroy;
+    head->output.base.enable = _enxb_output_enable;
+    head->output.base.disable = _enxb_output_disable;
+    head->output.base.switch_mode = _enxb_output_switch_mode;
+    head->output.base.attach_head = NULL;
+    head->output.base.start_repaint_loop = _enxb_output_start_repaint_loop;
+    head->output.base.repaint = _enxb_output_repaint;
+
+    return &head->output.base;
+}
+
+static ENXBHead *
+_enxb_head_new(ENXBBackend *backend, const gchar *name)
+{
+    ENXBHead *head;
+    struct weston_output *woutput;
+
+    head = g_new0(ENXBHead, 1);
+
+    weston_head_init(&head->base, name);
+    weston_head_set_connection_status(&head->base, true);
+    weston_compositor_add_head(backend->compositor, &head->base);
+
+    g_hash_table_insert(backend->heads, head->base.name, head);
+
+    woutput = weston_compositor_create_output_with_head(backend->compositor, &head->base);
+    g_return_val_if_fail(woutput == &head->output.base, NULL);
+
+    weston_head_set_monitor_strings(&head->base, "X11", name, NULL);
+
+    head->mode.flags = WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
+    head->mode.refresh = 60000;
+
+    wl_list_insert(&head->output.base.mode_list, &head->mode.link);
+    head->output.base.current_mode = &head->mode;
+    head->output.base.native_mode = &head->mode;
+
+    weston_output_set_transform(&head->output.base, WL_OUTPUT_TRANSFORM_NORMAL);
+    weston_output_set_scale(&head->output.base, 1);
+
+    weston_output_enable(&head->output.base);
+
+    return head;
 }
 
 static void
-_enxb_output_start_repaint_loop(struct weston_output *output)
+_enxb_head_free(gpointer data)
 {
-    struct timespec ts;
+    ENXBHead *head = data;
 
-    weston_compositor_read_presentation_clock(output->compositor, &ts);
-    weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+    weston_output_destroy(&head->output.base);
+    weston_head_release(&head->base);
+    g_free(head);
 }
 
+static inline gint
+_enxb_compute_scale_from_dpi(gdouble dpi)
+{
+    return (gint) ( dpi / 96. + 0.25 );
+}
 
-static int
-_enxb_output_finish_frame(gpointer user_data)
+static inline gint
+_enxb_compute_scale_from_size(gint w, gint h, gint mm_w, gint mm_h)
 {
-    ENXBOutput *output = user_data;
-    struct timespec ts;
+    if ( ( mm_w == 0 ) || ( mm_h == 0 ) )
+        return 1;
 
-    weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-    weston_output_finish_frame(&output->base, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
-    output->finish_frame_timer = 0;
+    gdouble dpi_x = ( (gdouble) w * 25.4 ) / (gdouble) mm_w;
+    gdouble dpi_y = ( (gdouble) h * 25.4 ) / (gdouble) mm_h;
+    gdouble dpi = MIN(dpi_x, dpi_y);
 
-    return G_SOURCE_REMOVE;
+    return _enxb_compute_scale_from_dpi(dpi);
 }
 
-static int
-_enxb_output_repaint(struct weston_output *woutput, pixman_region32_t *damage, void *repaint_data)
+static guint32
+_enxb_compute_refresh(xcb_randr_mode_info_t *mode)
 {
-    ENXBBackend *backend = wl_container_of(woutput->compositor->backend, backend, base);
-    ENXBOutput *output = wl_container_of(woutput, output, base);
-    struct weston_view *wview;
+    guint64 vtotal = mode->vtotal;
 
-    wl_list_for_each_reverse(wview, &backend->compositor->view_list, link)
+    if ( mode->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN )
+        vtotal *= 2;
+    if ( mode->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE )
+        vtotal /= 2;
+
+    if ( ( mode->htotal == 0 ) || ( vtotal == 0 ) || ( mode->dot_clock == 0 ) )
+        return 60000;
+
+    return ( (guint64) mode->dot_clock * 1000 + ( mode->htotal * vtotal ) / 2 ) / ( mode->htotal * vtotal );
+}
+
+/* An unplugged output may keep its CRTC for a while, we drop it right away */
+static gboolean
+_enxb_output_is_active(xcb_randr_crtc_t crtc, guint8 connection)
+{
+    return ( crtc != XCB_NONE ) && ( connection != XCB_RANDR_CONNECTION_DISCONNECTED );
+}
+
+static gboolean
+_enxb_head_has_output(gpointer key, gpointer value, gpointer user_data)
+{
+    ENXBHead *head = value;
+    return ( head->id == GPOINTER_TO_UINT(user_data) );
+}
+
+static gboolean
+_enxb_head_has_crtc(gpointer key, gpointer value, gpointer user_data)
+{
+    ENXBHead *head = value;
+    return ( head->crtc == GPOINTER_TO_UINT(user_data) );
+}
+
+static guint32
+_enxb_transform_from_rotation(guint16 rotation)
+{
+    guint32 transform;
+
+    switch ( rotation & ( XCB_RANDR_ROTATION_ROTATE_0 | XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_180 | XCB_RANDR_ROTATION_ROTATE_270 ) )
     {
-        ENXBView *view = _enxb_view_from_weston_view(backend, wview);
-        if ( view == NULL )
-            continue;
+    case XCB_RANDR_ROTATION_ROTATE_90:
+        transform = WL_OUTPUT_TRANSFORM_90;
+    break;
+    case XCB_RANDR_ROTATION_ROTATE_180:
+        transform = WL_OUTPUT_TRANSFORM_180;
+    break;
+    case XCB_RANDR_ROTATION_ROTATE_270:
+        transform = WL_OUTPUT_TRANSFORM_270;
+    break;
+    default:
+        transform = WL_OUTPUT_TRANSFORM_NORMAL;
+    break;
+    }
+
+    /* A Y reflection is an X reflection rotated by 180° */
+    if ( rotation & XCB_RANDR_ROTATION_REFLECT_Y )
+        transform = ( transform + WL_OUTPUT_TRANSFORM_180 ) % WL_OUTPUT_TRANSFORM_FLIPPED;
+    if ( ( ( rotation & XCB_RANDR_ROTATION_REFLECT_X ) != 0 ) != ( ( rotation & XCB_RANDR_ROTATION_REFLECT_Y ) != 0 ) )
+        transform += WL_OUTPUT_TRANSFORM_FLIPPED;
+
+    return transform;
+}
+
+static void
+_enxb_head_update_crtc(ENXBBackend *backend, ENXBHead *head, xcb_randr_crtc_t crtc, gint16 x, gint16 y, guint16 width, guint16 height, xcb_randr_mode_t mode, guint16 rotation)
+{
+    guint32 refresh = GPOINTER_TO_UINT(g_hash_table_lookup(backend->modes, GUINT_TO_POINTER(mode)));
+    guint32 transform = _enxb_transform_from_rotation(rotation);
 
-        if ( view->view->plane == &backend->compositor->primary_plane )
-            _enxb_view_repaint(view);
+    if ( refresh == 0 )
+        refresh = 60000;
+
+    /* The CRTC size is rotated, Weston wants the mode size */
+    if ( transform & WL_OUTPUT_TRANSFORM_90 )
+    {
+        guint16 tmp = width;
+        width = height;
+        height = tmp;
     }
-    wl_signal_emit(&output->base.frame_signal, &output->base);
-    output->finish_frame_timer = g_timeout_add_full(G_PRIORITY_DEFAULT, 10, _enxb_output_finish_frame, output, NULL);
 
-    return 0;
+    gint scale = _enxb_compute_scale_from_size(width, height, head->base.mm_width, head->base.mm_height);
+
+    head->crtc = crtc;
+
+    if ( head->output.base.transform != transform )
+        weston_output_set_transform(&head->output.base, transform);
+
+    if ( ( head->mode.width != width ) || ( head->mode.height != height ) || ( head->mode.refresh != refresh ) || ( head->output.base.native_scale != scale ) )
+    {
+        head->mode.width = width;
+        head->mode.height = height;
+        head->mode.refresh = refresh;
+        weston_output_mode_set_native(&head->output.base, &head->mode, scale);
+    }
+
+    gint32 gx = head->screen->x + x;
+    if ( ( head->output.base.x != gx ) || ( head->output.base.y != y ) )
+        weston_output_move(&head->output.base, gx, y);
 }
 
 static void
-_enxb_output_destroy(struct weston_output *woutput)
+_enxb_head_update(ENXBBackend *backend, ENXBScreen *screen, xcb_randr_output_t id, xcb_randr_get_output_info_reply_t *output, xcb_randr_get_crtc_info_reply_t *crtc)
 {
-    ENXBHead *head = wl_container_of(woutput, head, output.base);
+    ENXBHead *head;
+    gchar *name;
+    gsize l = xcb_randr_get_output_info_name_length(output) + 1;
 
-    weston_output_release(&head->output.base);
+    /* Output names are only unique within a screen */
+    if ( screen != backend->screen )
+        l += 1 + 11;
+    name = g_newa(gchar, l);
+    if ( screen != backend->screen )
+        g_snprintf(name, l, "%.*s@%d", xcb_randr_get_output_info_name_length(output), (const gchar *) xcb_randr_get_output_info_name(output), screen->number);
+    else
+        g_snprintf(name, l, "%s", (const gchar *) xcb_randr_get_output_info_name(output));
+
+    head = g_hash_table_lookup(backend->heads, name);
+    if ( head == NULL )
+        head = _enxb_head_new(backend, name);
+
+    head->screen = screen;
+    head->id = id;
+    head->seen = TRUE;
+
+    if ( ( head->base.mm_width != (gint32) output->mm_width ) || ( head->base.mm_height != (gint32) output->mm_height ) )
+        weston_head_set_physical_size(&head->base, output->mm_width, output->mm_height);
+    _enxb_head_update_crtc(backend, head, output->crtc, crtc->x, crtc->y, crtc->width, crtc->height, crtc->mode, crtc->rotation);
 }
 
-static struct weston_output *
-_enxb_output_create(struct weston_compositor *compositor, const char *name)
+/* Another monitor may be plugged in the same connector, on the same CRTC */
+static void
+_enxb_head_update_output(ENXBBackend *backend, ENXBHead *head, xcb_timestamp_t cts)
 {
-    g_return_val_if_fail(name != NULL, NULL);
+    xcb_randr_get_output_info_cookie_t ocookie;
+    xcb_randr_get_output_info_reply_t *output;
 
-    ENXBBackend *backend = wl_container_of(compositor->backend, backend, base);
+    ocookie = xcb_randr_get_output_info(backend->xcb_connection, head->id, cts);
+    if ( ( output = xcb_randr_get_output_info_reply(backend->xcb_connection, ocookie, NULL) ) == NULL )
+        return;
+
+    if ( ! _enxb_output_is_active(output->crtc, output->connection) )
+        g_hash_table_remove(backend->heads, head->base.name);
+    else if ( ( head->base.mm_width != (gint32) output->mm_width ) || ( head->base.mm_height != (gint32) output->mm_height ) )
+    {
+        weston_head_set_physical_size(&head->base, output->mm_width, output->mm_height);
+
+        gint scale = _enxb_compute_scale_from_size(head->mode.width, head->mode.height, head->base.mm_width, head->base.mm_height);
+        if ( head->output.base.native_scale != scale )
+            weston_output_mode_set_native(&head->output.base, &head->mode, scale);
+    }
+
+    free(output);
+}
+
+static void
+_enxb_backend_place_screens(ENXBBackend *backend)
+{
+    gint32 x = 0;
+    gint i;
+
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+    {
+        backend->screens[i].x = x;
+        x += backend->screens[i].width;
+    }
+}
+
+static void
+_enxb_backend_check_screen_outputs(ENXBBackend *backend, ENXBScreen *screen)
+{
+    xcb_randr_get_screen_resources_current_cookie_t rcookie;
+    xcb_randr_get_screen_resources_current_reply_t *ressources;
+
+    rcookie = xcb_randr_get_screen_resources_current(backend->xcb_connection, screen->screen->root);
+    if ( ( ressources = xcb_randr_get_screen_resources_current_reply(backend->xcb_connection, rcookie, NULL) ) == NULL )
+    {
+        g_warning("Couldn't get RandR screen ressources");
+        return;
+    }
+
+    xcb_timestamp_t cts;
+    xcb_randr_output_t *randr_outputs;
+    xcb_randr_mode_info_t *modes;
+    gint i, length, modes_length;
+
+    cts = ressources->config_timestamp;
+
+    length = xcb_randr_get_screen_resources_current_outputs_length(ressources);
+    randr_outputs = xcb_randr_get_screen_resources_current_outputs(ressources);
+    modes_length = xcb_randr_get_screen_resources_current_modes_length(ressources);
+    modes = xcb_randr_get_screen_resources_current_modes(ressources);
+
+    for ( i = 0 ; i < modes_length ; ++i )
+        g_hash_table_insert(backend->modes, GUINT_TO_POINTER(modes[i].id), GUINT_TO_POINTER(_enxb_compute_refresh(&modes[i])));
+
+    xcb_randr_get_output_info_cookie_t *ocookies = g_new(xcb_randr_get_output_info_cookie_t, length);
+    xcb_randr_get_crtc_info_cookie_t *ccookies = g_new(xcb_randr_get_crtc_info_cookie_t, length);
+    xcb_randr_get_output_info_reply_t **outputs = g_new0(xcb_randr_get_output_info_reply_t *, length);
+    xcb_randr_get_output_info_reply_t *output;
+    xcb_randr_get_crtc_info_reply_t *crtc;
+
+    /* Send all the requests first to only wait for two round trips */
+    for ( i = 0 ; i < length ; ++i )
+        ocookies[i] = xcb_randr_get_output_info(backend->xcb_connection, randr_outputs[i], cts);
+    for ( i = 0 ; i < length ; ++i )
+    {
+        outputs[i] = xcb_randr_get_output_info_reply(backend->xcb_connection, ocookies[i], NULL);
+        if ( ( outputs[i] != NULL ) && _enxb_output_is_active(outputs[i]->crtc, outputs[i]->connection) )
+            ccookies[i] = xcb_randr_get_crtc_info(backend->xcb_connection, outputs[i]->crtc, cts);
+    }
+
+    for ( i = 0 ; i < length ; ++i )
+    {
+        if ( ( output = outputs[i] ) == NULL )
+            continue;
+        if ( ! _enxb_output_is_active(output->crtc, output->connection) )
+        {
+            free(output);
+            continue;
+        }
+
+        if ( ( crtc = xcb_randr_get_crtc_info_reply(backend->xcb_connection, ccookies[i], NULL) ) != NULL )
+        {
+            _enxb_head_update(backend, screen, randr_outputs[i], output, crtc);
+            free(crtc);
+        }
+        free(output);
+    }
+
+    g_free(outputs);
+    g_free(ccookies);
+    g_free(ocookies);
+    free(ressources);
+}
+
+static void
+_enxb_backend_check_outputs(ENXBBackend *backend)
+{
+    GHashTableIter iter;
     ENXBHead *head;
+    gint i;
 
-    head = g_hash_table_lookup(backend->heads, name);
-    g_return_val_if_fail(head != NULL, NULL);
+    g_hash_table_remove_all(backend->modes);
+
+    g_hash_table_iter_init(&iter, backend->heads);
+    while ( g_hash_table_iter_next(&iter, NULL, (gpointer *) &head) )
+        head->seen = FALSE;
+
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+        _enxb_backend_check_screen_outputs(backend, &backend->screens[i]);
+
+    g_hash_table_iter_init(&iter, backend->heads);
+    while ( g_hash_table_iter_next(&iter, NULL, (gpointer *) &head) )
+    {
+        if ( ! head->seen )
+            g_hash_table_iter_remove(&iter);
+    }
+}
+
+static void
+_enxb_backend_randr_notify(ENXBBackend *backend, xcb_randr_notify_event_t *e)
+{
+    ENXBHead *head;
+
+    switch ( e->subCode )
+    {
+    case XCB_RANDR_NOTIFY_CRTC_CHANGE:
+    {
+        xcb_randr_crtc_change_t *cc = &e->u.cc;
+
+        /* A disabled CRTC comes with an output change */
+        head = g_hash_table_find(backend->heads, _enxb_head_has_crtc, GUINT_TO_POINTER(cc->crtc));
+        if ( ( head == NULL ) || ( cc->mode == XCB_NONE ) )
+            break;
+
+        if ( g_hash_table_contains(backend->modes, GUINT_TO_POINTER(cc->mode)) )
+            _enxb_head_update_crtc(backend, head, cc->crtc, cc->x, cc->y, cc->width, cc->height, cc->mode, cc->rotation);
+        else
+            _enxb_backend_check_outputs(backend);
+    }
+    break;
+    case XCB_RANDR_NOTIFY_OUTPUT_CHANGE:
+    {
+        xcb_randr_output_change_t *oc = &e->u.oc;
+
+        head = g_hash_table_find(backend->heads, _enxb_head_has_output, GUINT_TO_POINTER(oc->output));
+        if ( ! _enxb_output_is_active(oc->crtc, oc->connection) )
+        {
+            if ( head != NULL )
+                g_hash_table_remove(backend->heads, head->base.name);
+        }
+        else if ( ( head == NULL ) || ( head->crtc != oc->crtc ) )
+            _enxb_backend_check_outputs(backend);
+        else
+            _enxb_head_update_output(backend, head, oc->config_timestamp);
+    }
+    break;
+    default:
+    break;
+    }
+}
+
+static void
+_enxb_view_present_exposed(ENXBView *self)
+{
+    _enxb_view_present(self, &self->expose);
+    pixman_region32_clear(&self->expose);
+    wl_list_remove(&self->expose_link);
+    wl_list_init(&self->expose_link);
+}
 
-    weston_output_init(&head->output.base, compositor, name);
+static void
+_enxb_backend_flush_motion(ENXBBackend *backend)
+{
+    struct timespec time;
 
-    head->output.base.destroy = _enxb_output_destroy;
-    head->output.base.enable = _enxb_output_enable;
-    head->output.base.disable = _enxb_output_disable;
-    head->output.base.switch_mode = _enxb_output_switch_mode;
-    head->output.base.attach_head = NULL;
-    head->output.base.start_repaint_loop = _enxb_output_start_repaint_loop;
-    head->output.base.repaint = _enxb_output_repaint;
+    if ( ! backend->motion.pending )
+        return;
+    backend->motion.pending = FALSE;
 
-    return &head->output.base;
+    weston_compositor_get_time(&time);
+    notify_motion_absolute(&backend->core_seat, &time, backend->motion.x, backend->motion.y);
+    notify_pointer_frame(&backend->core_seat);
 }
 
-static ENXBHead *
-_enxb_head_new(ENXBBackend *backend, const gchar *name)
+static void
+_enxb_backend_flush_xkb_state(ENXBBackend *backend)
 {
-    ENXBHead *head;
-    struct weston_output *woutput;
+    ENXBXkbState *state = &backend->xkb_state.next;
+    struct weston_keyboard *keyboard;
 
-    head = g_new0(ENXBHead, 1);
+    if ( ! backend->xkb_state.pending )
+        return;
+    backend->xkb_state.pending = FALSE;
 
-    weston_head_init(&head->base, name);
-    weston_head_set_connection_status(&head->base, true);
-    weston_compositor_add_head(backend->compositor, &head->base);
+    if ( backend->xkb_state.applied_valid && ( memcmp(state, &backend->xkb_state.applied, sizeof(ENXBXkbState)) == 0 ) )
+        return;
+    backend->xkb_state.applied = *state;
+    backend->xkb_state.applied_valid = TRUE;
 
-    g_hash_table_insert(backend->heads, head->base.name, head);
+    keyboard = weston_seat_get_keyboard(&backend->core_seat);
+    if ( xkb_state_update_mask(keyboard->xkb_state.state, state->base_mods, state->latched_mods, state->locked_mods, state->base_group, state->latched_group, state->locked_group) == 0 )
+        return;
 
-    woutput = weston_compositor_create_output_with_head(backend->compositor, &head->base);
-    g_return_val_if_fail(woutput == &head->output.base, NULL);
+    notify_modifiers(&backend->core_seat, wl_display_next_serial(backend->compositor->wl_display));
+}
 
-    weston_head_set_monitor_strings(&head->base, "X11", name, NULL);
+static gboolean
+_enxb_backend_batch_dispatch(gpointer user_data)
+{
+    ENXBBackend *backend = user_data;
+    ENXBView *view, *tmp;
 
-    head->mode.flags = WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
-    head->mode.refresh = 60000;
+    backend->batch_source = 0;
 
-    wl_list_insert(&head->output.base.mode_list, &head->mode.link);
-    head->output.base.current_mode = &head->mode;
-    head->output.base.native_mode = &head->mode;
+    _enxb_backend_flush_xkb_state(backend);
+    _enxb_backend_flush_motion(backend);
 
-    weston_output_set_transform(&head->output.base, WL_OUTPUT_TRANSFORM_NORMAL);
-    weston_output_set_scale(&head->output.base, 1);
+    wl_list_for_each_safe(view, tmp, &backend->exposed_views, expose_link)
+        _enxb_view_present_exposed(view);
 
-    weston_output_enable(&head->output.base);
+    xcb_flush(backend->xcb_connection);
 
-    return head;
+    return G_SOURCE_REMOVE;
 }
 
+/*
+ * Runs once the event queue is drained, so that work triggered
+ * by a burst of events is only done once
+ */
 static void
-_enxb_head_free(gpointer data)
+_enxb_backend_schedule_batch(ENXBBackend *backend)
 {
-    ENXBHead *head = data;
-
-    weston_output_destroy(&head->output.base);
-    weston_head_release(&head->base);
-    g_free(head);
+    if ( backend->batch_source == 0 )
+        backend->batch_source = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, _enxb_backend_batch_dispatch, backend, NULL);
 }
 
-static inline gint
-_enxb_compute_scale_from_dpi(gdouble dpi)
+static void
+_enxb_backend_motion(ENXBBackend *backend, ENXBView *view, gint16 x, gint16 y)
 {
-    return (gint) ( dpi / 96. + 0.25 );
+    /* Only the last position of a batch matters */
+    backend->motion.pending = TRUE;
+    backend->motion.x = view->screen->x + view->x_state.x + x;
+    backend->motion.y = view->x_state.y + y;
+    _enxb_backend_schedule_batch(backend);
 }
 
-static inline gint
-_enxb_compute_scale_from_size(gint w, gint h, gint mm_w, gint mm_h)
+static void
+_enxb_backend_button(ENXBBackend *backend, ENXBView *view, xcb_button_press_event_t *e, gboolean pressed)
 {
-    gdouble dpi_x = ( (gdouble) w * 25.4 ) / (gdouble) mm_w;
-    gdouble dpi_y = ( (gdouble) h * 25.4 ) / (gdouble) mm_h;
-    gdouble dpi = MIN(dpi_x, dpi_y);
+    struct timespec time;
+    guint32 button;
 
-    return _enxb_compute_scale_from_dpi(dpi);
+    /* Make sure the press lands on the surface below the pointer */
+    _enxb_backend_motion(backend, view, e->event_x, e->event_y);
+    _enxb_backend_flush_motion(backend);
+
+    weston_compositor_get_time(&time);
+
+    switch ( e->detail )
+    {
+    case 1:
+        button = BTN_LEFT;
+    break;
+    case 2:
+        button = BTN_MIDDLE;
+    break;
+    case 3:
+        button = BTN_RIGHT;
+    break;
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+    {
+        /* Scrolling is press-only */
+        if ( ! pressed )
+            return;
+
+        struct weston_pointer_axis_event axis = {
+            .axis = ( e->detail < 6 ) ? WL_POINTER_AXIS_VERTICAL_SCROLL : WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+            .value = ( e->detail % 2 ) ? 10 : -10,
+            .has_discrete = TRUE,
+            .discrete = ( e->detail % 2 ) ? 1 : -1,
+        };
+        notify_axis(&backend->core_seat, &time, &axis);
+        notify_pointer_frame(&backend->core_seat);
+        return;
+    }
+    default:
+        button = e->detail + BTN_SIDE - 8;
+    break;
+    }
+
+    notify_button(&backend->core_seat, &time, button, pressed ? WL_POINTER_BUTTON_STATE_PRESSED : WL_POINTER_BUTTON_STATE_RELEASED);
+    notify_pointer_frame(&backend->core_seat);
 }
 
-static void
-_enxb_head_update(ENXBBackend *backend, xcb_randr_get_output_info_reply_t *output, xcb_randr_get_crtc_info_reply_t *crtc)
+static gpointer
+_enxb_backend_keymap_thread(gpointer user_data)
 {
-    ENXBHead *head;
-    gchar *name;
-    gsize l = xcb_randr_get_output_info_name_length(output) + 1;
-
-    name = g_newa(gchar, l);
-    g_snprintf(name, l, "%s", (const gchar *) xcb_randr_get_output_info_name(output));
+    ENXBBackend *backend = user_data;
 
-    head = g_hash_table_lookup(backend->heads, name);
-    if ( head == NULL )
-        head = _enxb_head_new(backend, name);
+    /* The main thread does not touch the context while we run */
+    backend->keymap.result = xkb_x11_keymap_new_from_device(backend->xkb_context, backend->keymap.connection, backend->keymap.device_id, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if ( backend->keymap.result != NULL )
+        backend->keymap.result_string = xkb_keymap_get_as_string(backend->keymap.result, XKB_KEYMAP_FORMAT_TEXT_V1);
 
-    head->mode.width = crtc->width;
-    head->mode.height = crtc->height;
+    g_source_attach(backend->keymap.done, NULL);
 
-    weston_head_set_physical_size(&head->base, output->mm_width, output->mm_height);
-    /* TODO: use crtc transform */
-    weston_output_set_transform(&head->output.base, WL_OUTPUT_TRANSFORM_NORMAL);
-    weston_output_mode_set_native(&head->output.base, &head->mode, _enxb_compute_scale_from_size(crtc->width, crtc->height, output->mm_width, output->mm_height));
-    weston_output_move(&head->output.base, crtc->x, crtc->y);
+    return NULL;
 }
 
-static void
-_enxb_backend_check_outputs(ENXBBackend *backend)
+static void _enxb_backend_keymap_start(ENXBBackend *backend);
+
+static gboolean
+_enxb_backend_keymap_done(gpointer user_data)
 {
-    xcb_randr_get_screen_resources_current_cookie_t rcookie;
-    xcb_randr_get_screen_resources_current_reply_t *ressources;
+    ENXBBackend *backend = user_data;
+    struct xkb_keymap *keymap;
+    gchar *string;
 
-    rcookie = xcb_randr_get_screen_resources_current(backend->xcb_connection, backend->screen->root);
-    if ( ( ressources = xcb_randr_get_screen_resources_current_reply(backend->xcb_connection, rcookie, NULL) ) == NULL )
-    {
-        g_warning("Couldn't get RandR screen ressources");
-        return;
-    }
+    g_thread_join(backend->keymap.thread);
+    backend->keymap.thread = NULL;
+    g_source_unref(backend->keymap.done);
+    backend->keymap.done = NULL;
 
-    xcb_timestamp_t cts;
-    xcb_randr_output_t *randr_outputs;
-    gint i, length;
+    keymap = backend->keymap.result;
+    string = backend->keymap.result_string;
+    backend->keymap.result = NULL;
+    backend->keymap.result_string = NULL;
 
-    cts = ressources->config_timestamp;
+    /* Map notifications often leave the keymap as it was */
+    if ( ( keymap != NULL ) && ( ( string == NULL ) || ( backend->keymap.current_string == NULL ) || ( strcmp(string, backend->keymap.current_string) != 0 ) ) )
+    {
+        weston_seat_update_keymap(&backend->core_seat, keymap);
+        free(backend->keymap.current_string);
+        backend->keymap.current_string = string;
+        string = NULL;
+
+        /* The seat got a fresh state, re-apply the last one we know */
+        backend->xkb_state.applied_valid = FALSE;
+        backend->xkb_state.pending = TRUE;
+        _enxb_backend_schedule_batch(backend);
+    }
+    if ( keymap != NULL )
+        xkb_keymap_unref(keymap);
+    free(string);
 
-    length = xcb_randr_get_screen_resources_current_outputs_length(ressources);
-    randr_outputs = xcb_randr_get_screen_resources_current_outputs(ressources);
+    if ( backend->keymap.dirty )
+        _enxb_backend_keymap_start(backend);
 
-    GHashTableIter iter;
-    ENXBHead *head;
-    g_hash_table_iter_init(&iter, backend->heads);
-    while ( g_hash_table_iter_next(&iter, NULL, (gpointer *) &head) )
-        weston_head_set_connection_status(&head->base, false);
+    return G_SOURCE_REMOVE;
+}
 
-    xcb_randr_get_output_info_reply_t *output;
-    xcb_randr_get_crtc_info_reply_t *crtc;
-    for ( i = 0 ; i < length ; ++i )
+static void
+_enxb_backend_keymap_start(ENXBBackend *backend)
+{
+    if ( backend->keymap.connection == NULL )
+        return;
+    if ( backend->keymap.thread != NULL )
     {
-        xcb_randr_get_output_info_cookie_t ocookie;
+        backend->keymap.dirty = TRUE;
+        return;
+    }
+    backend->keymap.dirty = FALSE;
 
-        ocookie = xcb_randr_get_output_info(backend->xcb_connection, randr_outputs[i], cts);
-        if ( ( output = xcb_randr_get_output_info_reply(backend->xcb_connection, ocookie, NULL) ) == NULL )
-            continue;
+    /* Created here so that destroy never races with the thread */
+    backend->keymap.done = g_idle_source_new();
+    g_source_set_callback(backend->keymap.done, _enxb_backend_keymap_done, backend, NULL);
+    backend->keymap.thread = g_thread_new("enxb-keymap", _enxb_backend_keymap_thread, backend);
+}
 
-        xcb_randr_get_crtc_info_cookie_t ccookie;
+static gboolean
+_enxb_backend_keymap_timeout(gpointer user_data)
+{
+    ENXBBackend *backend = user_data;
 
-        ccookie = xcb_randr_get_crtc_info(backend->xcb_connection, output->crtc, cts);
-        if ( ( crtc = xcb_randr_get_crtc_info_reply(backend->xcb_connection, ccookie, NULL) ) != NULL )
-        {
-            _enxb_head_update(backend, output, crtc);
-            free(crtc);
-        }
-        free(output);
-    }
+    backend->keymap.timeout = 0;
+    _enxb_backend_keymap_start(backend);
 
-    g_hash_table_iter_init(&iter, backend->heads);
-    while ( g_hash_table_iter_next(&iter, NULL, (gpointer *) &head) )
-    {
-        if ( ! weston_head_is_connected(&head->base) )
-            g_hash_table_iter_remove(&iter);
-    }
+    return G_SOURCE_REMOVE;
 }
 
 static gboolean
@@ -693,9 +2315,23 @@ _enxb_backend_event_callback(xcb_generic_event_t *event, gpointer user_data)
     switch ( type - backend->randr_event_base )
     {
     case XCB_RANDR_SCREEN_CHANGE_NOTIFY:
+    {
+        xcb_randr_screen_change_notify_event_t *e = (xcb_randr_screen_change_notify_event_t *) event;
+        gint i;
+
+        /* Screens to the right move along with the width */
+        for ( i = 0 ; i < backend->screens_count ; ++i )
+        {
+            /* The size is swapped when the first CRTC is rotated */
+            if ( backend->screens[i].screen->root == e->root )
+                backend->screens[i].width = ( e->rotation & ( XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270 ) ) ? e->height : e->width;
+        }
+        _enxb_backend_place_screens(backend);
         _enxb_backend_check_outputs(backend);
         return G_SOURCE_CONTINUE;
+    }
     case XCB_RANDR_NOTIFY:
+        _enxb_backend_randr_notify(backend, (xcb_randr_notify_event_t *) event);
         return G_SOURCE_CONTINUE;
     default:
     break;
@@ -706,22 +2342,45 @@ _enxb_backend_event_callback(xcb_generic_event_t *event, gpointer user_data)
     {
     case XCB_XKB_MAP_NOTIFY:
     {
-        struct xkb_keymap *keymap = xkb_x11_keymap_new_from_device(backend->xkb_context, backend->xcb_connection, backend->xkb_device_id, XKB_KEYMAP_COMPILE_NO_FLAGS);
-        weston_seat_update_keymap(&backend->core_seat, keymap);
-        xkb_keymap_unref(keymap);
+        /* Map notifications come in bursts, wait for the last one */
+        if ( backend->keymap.timeout > 0 )
+            g_source_remove(backend->keymap.timeout);
+        backend->keymap.timeout = g_timeout_add(50, _enxb_backend_keymap_timeout, backend);
         return G_SOURCE_CONTINUE;
     }
     case XCB_XKB_STATE_NOTIFY:
     {
         xcb_xkb_state_notify_event_t *e = (xcb_xkb_state_notify_event_t *) event;
-        struct weston_keyboard *keyboard = weston_seat_get_keyboard(&backend->core_seat);
-        xkb_state_update_mask(keyboard->xkb_state.state ,e->baseMods, e->latchedMods, e->lockedMods, e->baseGroup, e->latchedGroup, e->lockedGroup);
-
-        notify_modifiers(&backend->core_seat, wl_display_next_serial(backend->compositor->wl_display));
+        ENXBXkbState *state = &backend->xkb_state.next;
+
+        /* Only the last state of a burst matters */
+        state->base_mods = e->baseMods;
+        state->latched_mods = e->latchedMods;
+        state->locked_mods = e->lockedMods;
+        state->base_group = e->baseGroup;
+        state->latched_group = e->latchedGroup;
+        state->locked_group = e->lockedGroup;
+        backend->xkb_state.pending = TRUE;
+        _enxb_backend_schedule_batch(backend);
         return G_SOURCE_CONTINUE;
     }
     }
 
+    /* MIT-SHM events */
+    if ( backend->shm && ( type == backend->shm_event_base + XCB_SHM_COMPLETION ) )
+    {
+        xcb_shm_completion_event_t *e = (xcb_shm_completion_event_t *) event;
+        ENXBShmSegment *segment = g_hash_table_lookup(backend->shm_segments, GUINT_TO_POINTER(e->shmseg));
+
+        if ( ( segment != NULL ) && ( segment->pending > 0 ) && ( --segment->pending == 0 ) )
+        {
+            ENXBSurface *surface = wl_container_of(segment, surface, shm);
+            if ( pixman_region32_not_empty(&surface->deferred) )
+                weston_surface_schedule_repaint(surface->surface);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
     /* XFixes events */
     if ( backend->xfixes )
     switch ( type - backend->xfixes_event_base )
@@ -729,11 +2388,20 @@ _enxb_backend_event_callback(xcb_generic_event_t *event, gpointer user_data)
     case XCB_XFIXES_SELECTION_NOTIFY:
     {
         xcb_xfixes_selection_notify_event_t *e = (xcb_xfixes_selection_notify_event_t *)event;
-        if ( e->selection == backend->ewmh._NET_WM_CM_Sn[backend->screen_number] )
+        gint i;
+        for ( i = 0 ; i < backend->screens_count ; ++i )
         {
+            ENXBScreen *screen = &backend->screens[i];
+            if ( e->selection != backend->ewmh._NET_WM_CM_Sn[screen->number] )
+                continue;
+
             gboolean compositing = ( e->owner != XCB_WINDOW_NONE );
-            if ( backend->compositing != compositing )
-                backend->compositing = compositing;
+            if ( screen->compositing != compositing )
+            {
+                /* Views switch between X and CPU alpha on next repaint */
+                screen->compositing = compositing;
+                weston_compositor_schedule_repaint(backend->compositor);
+            }
         }
 
         return G_SOURCE_CONTINUE;
@@ -750,36 +2418,78 @@ _enxb_backend_event_callback(xcb_generic_event_t *event, gpointer user_data)
         ENXBView *view;
 
         view = g_hash_table_lookup(backend->views, GINT_TO_POINTER(e->window));
-        if ( ( view == NULL ) || ( view->surface == NULL ) || ( view->surface->cairo_surface == NULL ) )
+        if ( view == NULL )
             break;
 
-        cairo_t *cr;
-        cr = cairo_create(view->cairo_surface);
-        cairo_set_source_surface(cr, view->surface->cairo_surface, 0, 0);
-        cairo_rectangle(cr, e->x, e->y, e->width, e->height);
-        cairo_clip(cr);
-        if ( view->view->alpha < 1.0 )
-            cairo_paint_with_alpha(cr, view->view->alpha);
-        else
-            cairo_paint(cr);
-        cairo_destroy(cr);
-        xcb_flush(backend->xcb_connection);
+        pixman_region32_union_rect(&view->expose, &view->expose, e->x, e->y, e->width, e->height);
+        if ( wl_list_empty(&view->expose_link) )
+            wl_list_insert(&backend->exposed_views, &view->expose_link);
+        if ( e->count == 0 )
+            _enxb_view_present_exposed(view);
+        _enxb_backend_schedule_batch(backend);
     }
     break;
     case XCB_BUTTON_PRESS:
+    case XCB_BUTTON_RELEASE:
     {
-        //xcb_button_press_event_t *e = (xcb_button_press_event_t *)event;
+        xcb_button_press_event_t *e = (xcb_button_press_event_t *)event;
+        ENXBView *view;
+
+        view = g_hash_table_lookup(backend->views, GINT_TO_POINTER(e->event));
+        if ( view == NULL )
+            break;
+
+        _enxb_backend_button(backend, view, e, ( type == XCB_BUTTON_PRESS ));
     }
     break;
-    case XCB_BUTTON_RELEASE:
+    case XCB_MOTION_NOTIFY:
+    {
+        xcb_motion_notify_event_t *e = (xcb_motion_notify_event_t *)event;
+        ENXBView *view;
+
+        view = g_hash_table_lookup(backend->views, GINT_TO_POINTER(e->event));
+        if ( view == NULL )
+            break;
+
+        _enxb_backend_motion(backend, view, e->event_x, e->event_y);
+    }
+    break;
+    case XCB_ENTER_NOTIFY:
     {
-        //xcb_button_release_event_t *e = (xcb_button_release_event_t *)event;
+        xcb_enter_notify_event_t *e = (xcb_enter_notify_event_t *)event;
+        ENXBView *view;
+
+        view = g_hash_table_lookup(backend->views, GINT_TO_POINTER(e->event));
+        if ( view == NULL )
+            break;
+
+        _enxb_backend_motion(backend, view, e->event_x, e->event_y);
+    }
+    break;
+    case XCB_LEAVE_NOTIFY:
+    {
+        xcb_leave_notify_event_t *e = (xcb_leave_notify_event_t *)event;
+
+        /* Grabs keep the pointer with us */
+        if ( e->mode != XCB_NOTIFY_MODE_NORMAL )
+            break;
+
+        /* notify_pointer_focus() ignores a NULL output */
+        backend->motion.pending = FALSE;
+        weston_pointer_clear_focus(weston_seat_get_pointer(&backend->core_seat));
     }
     break;
     case XCB_PROPERTY_NOTIFY:
     {
     }
     break;
+    case 0:
+    {
+        /* Errors from our unchecked requests */
+        xcb_generic_error_t *e = (xcb_generic_error_t *)event;
+        g_warning("X error %d on request %d.%d for resource 0x%x", e->error_code, e->major_code, e->minor_code, e->resource_id);
+    }
+    break;
     default:
     break;
     }
@@ -788,37 +2498,37 @@ _enxb_backend_event_callback(xcb_generic_event_t *event, gpointer user_data)
 }
 
 static gboolean
-_enxb_get_colormap(ENXBBackend *backend)
+_enxb_get_colormap(ENXBBackend *backend, ENXBScreen *screen)
 {
     gboolean ret = FALSE;
 
-    backend->visual = xcb_aux_find_visual_by_attrs(backend->screen, XCB_VISUAL_CLASS_DIRECT_COLOR, 32);
-    if ( backend->visual == NULL )
-        backend->visual = xcb_aux_find_visual_by_attrs(backend->screen, XCB_VISUAL_CLASS_TRUE_COLOR, 32);
+    screen->visual = xcb_aux_find_visual_by_attrs(screen->screen, XCB_VISUAL_CLASS_DIRECT_COLOR, 32);
+    if ( screen->visual == NULL )
+        screen->visual = xcb_aux_find_visual_by_attrs(screen->screen, XCB_VISUAL_CLASS_TRUE_COLOR, 32);
 
-    if ( backend->visual != NULL )
+    if ( screen->visual != NULL )
     {
         xcb_void_cookie_t c;
         xcb_generic_error_t *e;
-        backend->map = xcb_generate_id(backend->xcb_connection);
-        c = xcb_create_colormap_checked(backend->xcb_connection, ( backend->visual->_class == XCB_VISUAL_CLASS_DIRECT_COLOR) ? XCB_COLORMAP_ALLOC_ALL : XCB_COLORMAP_ALLOC_NONE, backend->map, backend->screen->root, backend->visual->visual_id);
+        screen->map = xcb_generate_id(backend->xcb_connection);
+        c = xcb_create_colormap_checked(backend->xcb_connection, ( screen->visual->_class == XCB_VISUAL_CLASS_DIRECT_COLOR) ? XCB_COLORMAP_ALLOC_ALL : XCB_COLORMAP_ALLOC_NONE, screen->map, screen->screen->root, screen->visual->visual_id);
         e = xcb_request_check(backend->xcb_connection, c);
         if ( e == NULL )
             ret = TRUE;
         else
         {
-            xcb_free_colormap(backend->xcb_connection, backend->map);
+            xcb_free_colormap(backend->xcb_connection, screen->map);
             free(e);
         }
     }
 
     if ( ! ret )
     {
-        backend->visual = xcb_aux_find_visual_by_id(backend->screen, backend->screen->root_visual);
-        backend->map = backend->screen->default_colormap;
+        screen->visual = xcb_aux_find_visual_by_id(screen->screen, screen->screen->root_visual);
+        screen->map = screen->screen->default_colormap;
     }
 
-    backend->depth = xcb_aux_get_depth_of_visual(backend->screen, backend->visual->visual_id);
+    screen->depth = xcb_aux_get_depth_of_visual(screen->screen, screen->visual->visual_id);
     return ret;
 }
 
@@ -827,11 +2537,47 @@ _enxb_backend_destroy(struct weston_compositor *compositor)
 {
     ENXBBackend *backend = wl_container_of(compositor->backend, backend, base);
 
-    if ( backend->custom_map )
-        xcb_free_colormap(backend->xcb_connection, backend->map);
+    if ( backend->batch_source > 0 )
+        g_source_remove(backend->batch_source);
+
+    if ( backend->keymap.timeout > 0 )
+        g_source_remove(backend->keymap.timeout);
+    if ( backend->keymap.thread != NULL )
+    {
+        g_thread_join(backend->keymap.thread);
+        g_source_destroy(backend->keymap.done);
+        g_source_unref(backend->keymap.done);
+        if ( backend->keymap.result != NULL )
+            xkb_keymap_unref(backend->keymap.result);
+        free(backend->keymap.result_string);
+    }
+    free(backend->keymap.current_string);
+    if ( backend->keymap.connection != NULL )
+        xcb_disconnect(backend->keymap.connection);
+
+    gint i;
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+    {
+        ENXBScreen *screen = &backend->screens[i];
+
+        xcb_free_gc(backend->xcb_connection, screen->gc);
+
+        if ( screen->custom_map )
+            xcb_free_colormap(backend->xcb_connection, screen->map);
+
+        xcb_window_t window;
+        while ( ( window = GPOINTER_TO_UINT(g_queue_pop_head(&screen->window_pool)) ) != XCB_NONE )
+            xcb_destroy_window(backend->xcb_connection, window);
+
+        g_array_unref(screen->stack);
+    }
+    g_free(backend->screens);
 
+    g_hash_table_unref(backend->shm_segments);
+    g_hash_table_unref(backend->weston_views);
     g_hash_table_unref(backend->views);
     g_hash_table_unref(backend->heads);
+    g_hash_table_unref(backend->modes);
 
     g_water_xcb_source_free(backend->source);
 
@@ -848,20 +2594,41 @@ _enxb_backend_init(struct weston_compositor *compositor, ENXBBackendConfig *conf
 
     backend->base.create_output = _enxb_output_create;
     backend->base.destroy = _enxb_backend_destroy;
+    backend->base.repaint_flush = _enxb_backend_repaint_flush;
 
     const xcb_query_extension_reply_t *extension_query;
-    gint screen;
-    backend->source = g_water_xcb_source_new(NULL, NULL, &screen, _enxb_backend_event_callback, backend, NULL);
+    gint screen_number;
+    backend->source = g_water_xcb_source_new(NULL, NULL, &screen_number, _enxb_backend_event_callback, backend, NULL);
     if ( backend->source == NULL )
         goto fail;
 
     backend->xcb_connection = g_water_xcb_source_get_connection(backend->source);
-    backend->screen_number = screen;
-    backend->screen = xcb_aux_get_screen(backend->xcb_connection, screen);
 
-    xcb_intern_atom_cookie_t *ac;
+    xcb_screen_iterator_t si;
+    gint i;
+    si = xcb_setup_roots_iterator(xcb_get_setup(backend->xcb_connection));
+    backend->screens_count = si.rem;
+    backend->screens = g_new0(ENXBScreen, backend->screens_count);
+    for ( i = 0 ; si.rem > 0 ; xcb_screen_next(&si), ++i )
+    {
+        backend->screens[i].number = i;
+        backend->screens[i].screen = si.data;
+        backend->screens[i].width = si.data->width_in_pixels;
+    }
+    backend->screen = &backend->screens[screen_number];
+    _enxb_backend_place_screens(backend);
+
+    xcb_intern_atom_cookie_t *ac, oac;
+    xcb_intern_atom_reply_t *oar;
     ac = xcb_ewmh_init_atoms(backend->xcb_connection, &backend->ewmh);
+    oac = xcb_intern_atom(backend->xcb_connection, FALSE, strlen("_NET_WM_WINDOW_OPACITY"), "_NET_WM_WINDOW_OPACITY");
     xcb_ewmh_init_atoms_replies(&backend->ewmh, ac, NULL);
+    oar = xcb_intern_atom_reply(backend->xcb_connection, oac, NULL);
+    if ( oar != NULL )
+    {
+        backend->net_wm_window_opacity = oar->atom;
+        free(oar);
+    }
 
     extension_query = xcb_get_extension_data(backend->xcb_connection, &xcb_randr_id);
     if ( ! extension_query->present )
@@ -869,12 +2636,32 @@ _enxb_backend_init(struct weston_compositor *compositor, ENXBBackendConfig *conf
         g_warning("No RandR extension");
         goto fail;
     }
+
+    xcb_randr_query_version_cookie_t rvc;
+    xcb_randr_query_version_reply_t *rvr;
+    rvc = xcb_randr_query_version(backend->xcb_connection, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+    rvr = xcb_randr_query_version_reply(backend->xcb_connection, rvc, NULL);
+    if ( rvr == NULL )
+    {
+        g_warning("Cannot get RandR version");
+        goto fail;
+    }
+    /* We need GetScreenResourcesCurrent, added in 1.3 */
+    backend->randr = ( rvr->major_version > 1 ) || ( ( rvr->major_version == 1 ) && ( rvr->minor_version >= 3 ) );
+    free(rvr);
+    if ( ! backend->randr )
+    {
+        g_warning("RandR 1.3 is required");
+        goto fail;
+    }
+
     backend->randr_event_base = extension_query->first_event;
-    xcb_randr_select_input(backend->xcb_connection, backend->screen->root,
-            XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
-            XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
-            XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
-            XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+        xcb_randr_select_input(backend->xcb_connection, backend->screens[i].screen->root,
+                XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE |
+                XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
 
 
     weston_seat_init(&backend->core_seat, backend->compositor, "default");
@@ -926,56 +2713,148 @@ _enxb_backend_init(struct weston_compositor *compositor, ENXBBackendConfig *conf
         {
             weston_seat_init_keyboard(&backend->core_seat, keymap);
             backend->xkb = TRUE;
+
+            backend->keymap.current_string = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
             xkb_keymap_unref(keymap);
+
+            /*
+             * Waiting for replies would read our events off the socket
+             * and the main loop would not wake up for them
+             */
+            backend->keymap.connection = xcb_connect(NULL, NULL);
+            if ( ( ! xcb_connection_has_error(backend->keymap.connection) ) && xkb_x11_setup_xkb_extension(backend->keymap.connection, XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION, XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS, NULL, NULL, NULL, NULL) )
+                backend->keymap.device_id = xkb_x11_get_core_keyboard_device_id(backend->keymap.connection);
+            else
+                backend->keymap.device_id = -1;
+            if ( backend->keymap.device_id < 0 )
+            {
+                g_warning("Couldn't open the keymap connection, keymap changes will be ignored");
+                xcb_disconnect(backend->keymap.connection);
+                backend->keymap.connection = NULL;
+            }
         }
     }
 
-    backend->custom_map = _enxb_get_colormap(backend);
+    extension_query = xcb_get_extension_data(backend->xcb_connection, &xcb_xfixes_id);
+    if ( ! extension_query->present )
+        g_warning("No XFixes extension");
+    else
+    {
+        xcb_xfixes_query_version_cookie_t vc;
+        xcb_xfixes_query_version_reply_t *r;
+        vc = xcb_xfixes_query_version(backend->xcb_connection, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+        r = xcb_xfixes_query_version_reply(backend->xcb_connection, vc, NULL);
+        if ( r == NULL )
+            g_warning("Cannot get XFixes version");
+        else
+        {
+            backend->xfixes = TRUE;
+            backend->xfixes_event_base = extension_query->first_event;
+            free(r);
+        }
+    }
 
-    if ( backend->custom_map )
+    extension_query = xcb_get_extension_data(backend->xcb_connection, &xcb_shm_id);
+    if ( ! extension_query->present )
+        g_warning("No MIT-SHM extension");
+    else
     {
-        /* We have a 32bit color map, try to support compositing */
-        xcb_get_selection_owner_cookie_t oc;
-        xcb_window_t owner;
-        oc = xcb_ewmh_get_wm_cm_owner(&backend->ewmh, backend->screen_number);
-        backend->compositing = xcb_ewmh_get_wm_cm_owner_reply(&backend->ewmh, oc, &owner, NULL) && ( owner != XCB_WINDOW_NONE );
+        xcb_shm_query_version_cookie_t vc;
+        xcb_shm_query_version_reply_t *r;
+        vc = xcb_shm_query_version(backend->xcb_connection);
+        r = xcb_shm_query_version_reply(backend->xcb_connection, vc, NULL);
+        if ( r == NULL )
+            g_warning("Cannot get MIT-SHM version");
+        else
+        {
+            /* We need fd passing, added in 1.2 */
+            backend->shm = ( r->major_version > 1 ) || ( ( r->major_version == 1 ) && ( r->minor_version >= 2 ) );
+            backend->shm_event_base = extension_query->first_event;
+            free(r);
+        }
+    }
 
-        extension_query = xcb_get_extension_data(backend->xcb_connection, &xcb_xfixes_id);
-        if ( ! extension_query->present )
-            g_warning("No XFixes extension");
+    extension_query = xcb_get_extension_data(backend->xcb_connection, &xcb_shape_id);
+    if ( ! extension_query->present )
+        g_warning("No Shape extension");
+    else
+    {
+        xcb_shape_query_version_cookie_t vc;
+        xcb_shape_query_version_reply_t *r;
+        vc = xcb_shape_query_version(backend->xcb_connection);
+        r = xcb_shape_query_version_reply(backend->xcb_connection, vc, NULL);
+        if ( r == NULL )
+            g_warning("Cannot get Shape version");
         else
         {
-            xcb_xfixes_query_version_cookie_t vc;
-            xcb_xfixes_query_version_reply_t *r;
-            vc = xcb_xfixes_query_version(backend->xcb_connection, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
-            r = xcb_xfixes_query_version_reply(backend->xcb_connection, vc, NULL);
-            if ( r == NULL )
-                g_warning("Cannot get XFixes version");
-            else
-            {
-                backend->xfixes = TRUE;
-                backend->xfixes_event_base = extension_query->first_event;
-                xcb_xfixes_select_selection_input_checked(backend->xcb_connection, backend->screen->root,
-                    backend->ewmh._NET_WM_CM_Sn[backend->screen_number],
+            /* We need input shapes, added in 1.1 */
+            backend->shape = ( r->major_version > 1 ) || ( ( r->major_version == 1 ) && ( r->minor_version >= 1 ) );
+            free(r);
+        }
+    }
+
+    for ( i = 0 ; i < backend->screens_count ; ++i )
+    {
+        ENXBScreen *screen = &backend->screens[i];
+
+        screen->custom_map = _enxb_get_colormap(backend, screen);
+
+        if ( screen->custom_map )
+        {
+            /* We have a 32bit color map, try to support compositing */
+            xcb_get_selection_owner_cookie_t oc;
+            xcb_window_t owner;
+            oc = xcb_ewmh_get_wm_cm_owner(&backend->ewmh, screen->number);
+            screen->compositing = xcb_ewmh_get_wm_cm_owner_reply(&backend->ewmh, oc, &owner, NULL) && ( owner != XCB_WINDOW_NONE );
+
+            if ( backend->xfixes )
+                xcb_xfixes_select_selection_input_checked(backend->xcb_connection, screen->screen->root,
+                    backend->ewmh._NET_WM_CM_Sn[screen->number],
                     XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER |
                     XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_WINDOW_DESTROY |
                     XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_CLIENT_CLOSE);
-            }
         }
+
+        if ( backend->shm )
+        {
+            if ( ( screen->depth != 24 ) && ( screen->depth != 32 ) )
+                g_debug("Unsupported depth %d for MIT-SHM on screen %d", screen->depth, screen->number);
+            else if ( ( screen->visual->red_mask != 0xff0000 ) || ( screen->visual->green_mask != 0xff00 ) || ( screen->visual->blue_mask != 0xff ) )
+                g_debug("Unsupported visual for MIT-SHM on screen %d", screen->number);
+            else
+                screen->shm = TRUE;
+        }
+
+        xcb_pixmap_t pixmap;
+        guint32 gcval[] = { 0 };
+
+        pixmap = xcb_generate_id(backend->xcb_connection);
+        xcb_create_pixmap(backend->xcb_connection, screen->depth, pixmap, screen->screen->root, 1, 1);
+        screen->gc = xcb_generate_id(backend->xcb_connection);
+        xcb_create_gc(backend->xcb_connection, screen->gc, pixmap, XCB_GC_GRAPHICS_EXPOSURES, gcval);
+        xcb_free_pixmap(backend->xcb_connection, pixmap);
+
+        g_queue_init(&screen->window_pool);
+        screen->stack = g_array_new(FALSE, FALSE, sizeof(xcb_window_t));
     }
 
     xcb_flush(backend->xcb_connection);
 
     backend->heads = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _enxb_head_free);
+    backend->modes = g_hash_table_new(g_direct_hash, g_direct_equal);
     _enxb_backend_check_outputs(backend);
 
     backend->views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    backend->weston_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    backend->shm_segments = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    wl_list_init(&backend->exposed_views);
 
     return TRUE;
 
 fail:
     if ( backend->source != NULL )
         g_water_xcb_source_free(backend->source);
+    g_free(backend->screens);
     g_free(backend);
     return FALSE;
 }
@@ -991,6 +2870,21 @@ weston_backend_init(struct weston_compositor *compositor, struct weston_backend_
         return -1;
 
     compositor->renderer = &_enxb_renderer;
+    compositor->read_format = PIXMAN_a8r8g8b8;
+
+#ifdef HAVE_LINUX_DMABUF
+    /* Creates the zwp_linux_dmabuf_v1 global, clients cannot import without it */
+    if ( linux_dmabuf_setup(compositor) < 0 )
+        g_warning("Couldn't set up linux-dmabuf");
+#endif /* HAVE_LINUX_DMABUF */
+
+    /* ARGB8888 and XRGB8888 are always advertised */
+    gsize i;
+    for ( i = 0 ; i < G_N_ELEMENTS(_enxb_shm_formats) ; ++i )
+    {
+        if ( ( _enxb_shm_formats[i].format != WL_SHM_FORMAT_ARGB8888 ) && ( _enxb_shm_formats[i].format != WL_SHM_FORMAT_XRGB8888 ) )
+            wl_display_add_shm_format(compositor->wl_display, _enxb_shm_formats[i].format);
+    }
 
     return 0;
 }